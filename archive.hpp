@@ -0,0 +1,339 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Multi-file archives.
+//
+// The files of a directory tree are treated as one stream which is cut
+// into chunks. Small files share a chunk and large files span several,
+// so the work is shared evenly between the workers however the sizes
+// are distributed. Each chunk is an independent range_encoder stream.
+//
+//   "rcarc"       8 bytes
+//   chunks        in any order
+//   directory     a range_encoder stream
+//   trailer       directory offset, coded size and raw size, 8 bytes each
+//                 then "rcardir", 8 bytes
+//
+// The directory holds the chunk size, the offset, coded size and raw size
+// of each chunk then the path, size and stream offset of each file.
+//
+// POSIX only for now.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef _ARCHIVE_HPP_INCLUDED_
+#define _ARCHIVE_HPP_INCLUDED_
+
+#include <cstdint>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <mutex>
+#include <atomic>
+
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "map.hpp"
+#include "parallel_coder.hpp"
+
+class archive {
+public:
+  static const size_t default_chunk_size = 0x400000;
+
+  struct entry {
+    std::string path;
+    uint64_t size;
+    uint64_t offset;
+
+    // where the file was read from when creating an archive.
+    std::string source;
+  };
+
+  struct chunk {
+    uint64_t offset;
+    uint64_t coded_size;
+    uint64_t raw_size;
+  };
+
+  const std::vector<entry> &entries() const { return entries_; }
+
+  // add the files under path. Directories are walked in name order.
+  bool add(const std::string &path) {
+    struct stat st;
+    if (lstat(path.c_str(), &st) != 0) return false;
+    if (S_ISREG(st.st_mode)) {
+      // paths are stored relative.
+      size_t skip = 0;
+      while (skip != path.size() && (path[skip] == '/' || path.compare(skip, 2, "./") == 0)) {
+        skip += path[skip] == '/' ? 1 : 2;
+      }
+      entries_.push_back(entry{path.substr(skip), uint64_t(st.st_size), total_, path});
+      total_ += st.st_size;
+    } else if (S_ISDIR(st.st_mode)) {
+      DIR *dir = opendir(path.c_str());
+      if (!dir) return false;
+      std::vector<std::string> names;
+      while (dirent *d = readdir(dir)) {
+        if (strcmp(d->d_name, ".") && strcmp(d->d_name, "..")) names.push_back(d->d_name);
+      }
+      closedir(dir);
+      std::sort(names.begin(), names.end());
+      for (auto &name : names) {
+        if (!add(path == "." ? name : path + "/" + name)) return false;
+      }
+    }
+    return true;
+  }
+
+  // compress the added files to filename using num_threads workers.
+  template <class Context>
+  bool create(Context &ctxt, const char *filename, const numa_topology &topology, size_t num_threads) {
+    FILE *file = fopen(filename, "wb");
+    if (!file) return false;
+    fwrite(sig, 1, 8, file);
+    uint64_t file_offset = 8;
+
+    size_t num_chunks = size_t((total_ + chunk_size_ - 1) / chunk_size_);
+    chunks_.assign(num_chunks, chunk{0, 0, 0});
+
+    std::vector<size_t> worker_nodes = topology.workers(num_threads);
+    numa_scheduler scheduler(topology.num_nodes());
+    scheduler.reset(0, num_chunks, worker_nodes);
+    std::mutex mutex;
+    std::atomic<bool> failed{false};
+
+    numa_run(topology, worker_nodes, [&](size_t, size_t node) {
+      std::vector<uint8_t> in, out;
+      Context worker_ctxt = ctxt;
+      size_t index;
+      while (!failed && scheduler.next(node, index)) {
+        uint64_t begin = index * chunk_size_;
+        uint64_t end = std::min(total_, begin + chunk_size_);
+        in.resize(size_t(end - begin));
+        if (!gather(in.data(), begin, end)) {
+          failed = true;
+          break;
+        }
+        out.resize(range_block::bound(in.size()));
+        uint8_t *out_end = range_encoder(worker_ctxt, out.data(), out.data() + out.size(), in.data(), in.data() + in.size());
+
+        std::lock_guard<std::mutex> lock(mutex);
+        chunks_[index] = chunk{file_offset, uint64_t(out_end - out.data()), uint64_t(in.size())};
+        if (fwrite(out.data(), 1, out_end - out.data(), file) != size_t(out_end - out.data())) failed = true;
+        file_offset += out_end - out.data();
+      }
+    });
+
+    // the directory.
+    std::vector<uint8_t> dir;
+    put64(dir, chunk_size_);
+    put64(dir, chunks_.size());
+    for (auto &c : chunks_) {
+      put64(dir, c.offset);
+      put64(dir, c.coded_size);
+      put64(dir, c.raw_size);
+    }
+    put64(dir, entries_.size());
+    for (auto &e : entries_) {
+      put64(dir, e.path.size());
+      dir.insert(dir.end(), e.path.begin(), e.path.end());
+      put64(dir, e.size);
+      put64(dir, e.offset);
+    }
+
+    std::vector<uint8_t> coded(range_block::bound(dir.size()));
+    uint8_t *coded_end = range_encoder(ctxt, coded.data(), coded.data() + coded.size(), dir.data(), dir.data() + dir.size());
+    fwrite(coded.data(), 1, coded_end - coded.data(), file);
+
+    std::vector<uint8_t> trailer;
+    put64(trailer, file_offset);
+    put64(trailer, coded_end - coded.data());
+    put64(trailer, dir.size());
+    trailer.insert(trailer.end(), sig_end, sig_end + 8);
+    fwrite(trailer.data(), 1, trailer.size(), file);
+
+    bool ok = !failed && !ferror(file);
+    return fclose(file) == 0 && ok;
+  }
+
+  // read the directory of an archive.
+  template <class Context>
+  bool open(Context &ctxt, const char *filename) {
+    file_ = map(filename, "r");
+    const uint8_t *begin = file_.begin();
+    const uint8_t *end = file_.end();
+    if (!begin || file_.size() < 40 || memcmp(begin, sig, 8) || memcmp(end - 8, sig_end, 8)) return false;
+
+    const uint8_t *p = end - 32;
+    uint64_t dir_offset = get64(p), dir_coded = get64(p), dir_size = get64(p);
+    if (dir_offset > file_.size() - 32 || dir_coded > file_.size() - 32 - dir_offset) return false;
+
+    // each block of the directory is at most range_block::default_size bytes and has a header.
+    if (dir_size > dir_coded / range_block::header_size * range_block::default_size) return false;
+
+    std::vector<uint8_t> dir((size_t)dir_size);
+    ctxt.size = size_t(dir_size);
+    if (range_decoder(ctxt, dir.data(), dir.data() + dir.size(), begin + dir_offset, begin + dir_offset + dir_coded) != dir.data() + dir.size()) return false;
+
+    p = dir.data();
+    const uint8_t *dir_end = dir.data() + dir.size();
+    auto get = [&](uint64_t &value) {
+      if (dir_end - p < 8) return false;
+      value = get64(p);
+      return true;
+    };
+    uint64_t num_chunks, num_entries;
+    if (!get(chunk_size_) || !chunk_size_ || chunk_size_ > default_chunk_size || !get(num_chunks) || num_chunks > dir.size() / 24) return false;
+    chunks_.resize(size_t(num_chunks));
+    for (auto &c : chunks_) {
+      if (!get(c.offset) || !get(c.coded_size) || !get(c.raw_size)) return false;
+      if (c.offset > dir_offset || c.coded_size > dir_offset - c.offset || c.raw_size > chunk_size_) return false;
+    }
+    if (!get(num_entries) || num_entries > dir.size() / 24) return false;
+    entries_.resize(size_t(num_entries));
+    total_ = 0;
+    for (auto &e : entries_) {
+      uint64_t length;
+      if (!get(length) || length > uint64_t(dir_end - p)) return false;
+      e.path.assign((const char *)p, size_t(length));
+      p += length;
+      if (!get(e.size) || !get(e.offset)) return false;
+      total_ = std::max(total_, e.offset + e.size);
+    }
+    return total_ <= chunks_.size() * chunk_size_;
+  }
+
+  // extract all files, or just the one called name, to the current directory.
+  template <class Context>
+  bool extract(Context &ctxt, const char *name, const numa_topology &topology, size_t num_threads) {
+    std::vector<size_t> selected;
+    for (size_t i = 0; i != entries_.size(); ++i) {
+      if (!name || entries_[i].path == name) selected.push_back(i);
+    }
+    if (name && selected.empty()) return false;
+
+    // create the files first so that chunks can be written in any order.
+    std::vector<size_t> needed;
+    for (size_t i : selected) {
+      auto &e = entries_[i];
+      if (!safe_path(e.path) || !make_parents(e.path)) return false;
+      int fd = ::open(e.path.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+      if (fd == -1) return false;
+      bool ok = ftruncate(fd, off_t(e.size)) == 0;
+      close(fd);
+      if (!ok) return false;
+      if (e.size) {
+        for (size_t c = size_t(e.offset / chunk_size_); c <= size_t((e.offset + e.size - 1) / chunk_size_); ++c) {
+          needed.push_back(c);
+        }
+      }
+    }
+    std::sort(needed.begin(), needed.end());
+    needed.erase(std::unique(needed.begin(), needed.end()), needed.end());
+
+    std::vector<size_t> worker_nodes = topology.workers(num_threads);
+    numa_scheduler scheduler(topology.num_nodes());
+    scheduler.reset(0, needed.size(), worker_nodes);
+    std::atomic<bool> failed{false};
+
+    numa_run(topology, worker_nodes, [&](size_t, size_t node) {
+      std::vector<uint8_t> out;
+      Context worker_ctxt = ctxt;
+      size_t index;
+      while (!failed && scheduler.next(node, index)) {
+        size_t c = needed[index];
+        auto &ch = chunks_[c];
+        out.resize(size_t(ch.raw_size));
+        worker_ctxt.size = out.size();
+        const uint8_t *src = file_.begin() + ch.offset;
+        if (range_decoder(worker_ctxt, out.data(), out.data() + out.size(), src, src + ch.coded_size) != out.data() + out.size()) {
+          failed = true;
+          break;
+        }
+
+        // write the part of each selected file in this chunk.
+        uint64_t begin = c * chunk_size_;
+        uint64_t end = begin + ch.raw_size;
+        auto first = std::upper_bound(selected.begin(), selected.end(), begin, [&](uint64_t offset, size_t i) {
+          return offset < entries_[i].offset + entries_[i].size;
+        });
+        for (auto i = first; i != selected.end() && entries_[*i].offset < end; ++i) {
+          auto &e = entries_[*i];
+          uint64_t from = std::max(begin, e.offset);
+          uint64_t to = std::min(end, e.offset + e.size);
+          if (from >= to) continue;
+          int fd = ::open(e.path.c_str(), O_WRONLY);
+          bool ok = fd != -1 && pwrite(fd, out.data() + (from - begin), size_t(to - from), off_t(from - e.offset)) == ssize_t(to - from);
+          if (fd != -1) close(fd);
+          if (!ok) failed = true;
+        }
+      }
+    });
+    return !failed;
+  }
+
+private:
+  // copy the stream [begin, end) from the files.
+  bool gather(uint8_t *dest, uint64_t begin, uint64_t end) {
+    auto first = std::upper_bound(entries_.begin(), entries_.end(), begin, [](uint64_t offset, const entry &e) {
+      return offset < e.offset + e.size;
+    });
+    for (auto e = first; e != entries_.end() && e->offset < end; ++e) {
+      uint64_t from = std::max(begin, e->offset);
+      uint64_t to = std::min(end, e->offset + e->size);
+      if (from >= to) continue;
+      map in_file(e->source, "r");
+      if (!in_file.data() || in_file.size() < to - e->offset) {
+        printf("error: %s has changed\n", e->source.c_str());
+        return false;
+      }
+      memcpy(dest + (from - begin), in_file.begin() + (from - e->offset), size_t(to - from));
+    }
+    return true;
+  }
+
+  // reject absolute paths and paths leaving the current directory.
+  static bool safe_path(const std::string &path) {
+    if (path.empty() || path[0] == '/') return false;
+    for (size_t pos = 0; pos != std::string::npos; ) {
+      size_t next = path.find('/', pos);
+      if (path.compare(pos, next == std::string::npos ? std::string::npos : next - pos, "..") == 0) return false;
+      pos = next == std::string::npos ? next : next + 1;
+    }
+    return true;
+  }
+
+  static bool make_parents(const std::string &path) {
+    for (size_t pos = path.find('/'); pos != std::string::npos; pos = path.find('/', pos + 1)) {
+      std::string dir = path.substr(0, pos);
+      if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) return false;
+    }
+    return true;
+  }
+
+  static void put64(std::vector<uint8_t> &dest, uint64_t value) {
+    for (int i = 0; i != 8; ++i) dest.push_back(uint8_t(value >> (i * 8)));
+  }
+
+  static uint64_t get64(const uint8_t *&p) {
+    uint64_t value = 0;
+    for (int i = 0; i != 8; ++i) value |= uint64_t(*p++) << (i * 8);
+    return value;
+  }
+
+  static constexpr const char *sig = "rcarc\0\0";
+  static constexpr const char *sig_end = "rcardir";
+
+  uint64_t chunk_size_ = default_chunk_size;
+  uint64_t total_ = 0;
+  std::vector<entry> entries_;
+  std::vector<chunk> chunks_;
+  map file_ = map((const char *)nullptr, "");
+};
+
+#endif
@@ -0,0 +1,104 @@
+// creates an archive, extracts it and checks that corrupt trailers are rejected.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <random>
+
+#include "archive.hpp"
+
+struct context {
+  size_t size;
+
+  void error(size_t, const char *) {}
+};
+
+static bool write_file(const std::string &path, const std::vector<uint8_t> &data) {
+  FILE *file = fopen(path.c_str(), "wb");
+  if (!file) return false;
+  bool ok = fwrite(data.data(), 1, data.size(), file) == data.size();
+  return fclose(file) == 0 && ok;
+}
+
+static std::vector<uint8_t> read_file(const std::string &path) {
+  map file(path, "r");
+  return std::vector<uint8_t>(file.begin(), file.end());
+}
+
+// a copy of the archive with the 8 byte trailer field at offset from the end replaced.
+static bool patch_trailer(const std::string &from, const std::string &to, size_t offset, uint64_t value) {
+  std::vector<uint8_t> data = read_file(from);
+  if (data.size() < offset) return false;
+  for (int i = 0; i != 8; ++i) data[data.size() - offset + i] = uint8_t(value >> (i * 8));
+  return write_file(to, data);
+}
+
+int main() {
+  char dir_template[] = "/tmp/archive_test_XXXXXX";
+  const char *dir = mkdtemp(dir_template);
+  if (!dir || chdir(dir) != 0 || mkdir("in", 0755) != 0 || mkdir("out", 0755) != 0) {
+    printf("could not make a temporary directory\n");
+    return 1;
+  }
+
+  // files small enough to share a chunk and large enough to span several.
+  std::mt19937 rng(1);
+  static const size_t sizes[] = { 0, 1, 1000, 0x500000, 0x900000 };
+  std::vector<std::vector<uint8_t>> contents;
+  for (size_t size : sizes) {
+    std::vector<uint8_t> data(size);
+    for (auto &b : data) b = uint8_t('a' + rng() % 8);
+    write_file("in/" + std::to_string(contents.size()), data);
+    contents.push_back(data);
+  }
+
+  int failures = 0;
+  context ctxt;
+  numa_topology topology = numa_topology::fake(1);
+  archive arc;
+  if (!arc.add("in") || !arc.create(ctxt, "test.rca", topology, 2)) {
+    printf("could not create the archive\n");
+    return 1;
+  }
+
+  archive extracted;
+  if (chdir("out") != 0 || !extracted.open(ctxt, "../test.rca") || !extracted.extract(ctxt, nullptr, topology, 2) || chdir("..") != 0) {
+    printf("could not extract the archive\n");
+    ++failures;
+  } else {
+    for (size_t i = 0; i != contents.size(); ++i) {
+      if (read_file("out/in/" + std::to_string(i)) != contents[i]) {
+        printf("file %ld differs\n", long(i));
+        ++failures;
+      }
+    }
+  }
+
+  // the trailer is the directory offset, coded size and raw size then the signature.
+  struct corruption {
+    size_t offset;
+    uint64_t value;
+    const char *what;
+  };
+  static const corruption corruptions[] = {
+    { 32, ~(uint64_t)0 >> 1, "directory offset" },
+    { 24, ~(uint64_t)0 >> 1, "directory coded size" },
+    { 16, (uint64_t)1 << 62, "directory size" },
+    { 16, 1, "short directory size" },
+  };
+  for (auto &c : corruptions) {
+    archive bad;
+    if (!patch_trailer("test.rca", "bad.rca", c.offset, c.value) || bad.open(ctxt, "bad.rca")) {
+      printf("corrupt %s not rejected\n", c.what);
+      ++failures;
+    }
+  }
+
+  if (chdir("/tmp") != 0 || system(("rm -rf " + std::string(dir)).c_str()) != 0) {
+    printf("could not remove %s\n", dir);
+  }
+
+  printf("%s\n", failures ? "failed" : "ok");
+  return failures ? 1 : 0;
+}
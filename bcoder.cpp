@@ -11,16 +11,15 @@
 struct context {
   char sig[8] = "rcoder";
   size_t size;
-  std::array<uint32_t, 256+1> starts;
   static const uint32_t mask = 255;
 
   void error(size_t offset, const char *msg) {
-    printf("%s @ %lx", msg, long(offset));
+    printf("%s @ %lx\n", msg, long(offset));
   }
 };
 
 int usage() {
-  printf("usage: rcoder [-d] filename\n");
+  printf("usage: bcoder [-d] filename\n");
   return 1;
 }
 
@@ -52,36 +51,39 @@ int main(int argc, char **argv) {
 
   context ctxt;
   if (decode) {
-/*    std::string outname = filename;
-    size_t f = outname.rfind(".rc");
-    if (false && f == outname.size() - 3) {
-      outname.resize(outname.size() - 3);
-    } else {
-      outname.append(".dec");
-    }
+    std::string outname = filename;
+    outname.append(".dec");
 
     auto p = in_file.begin();
+    if (in_file.size() < sizeof(ctxt) || memcmp(p, ctxt.sig, sizeof(ctxt.sig))) {
+      printf("error: %s is not a bcoder file\n", filename);
+      return 1;
+    }
     memcpy(&ctxt, p, sizeof(ctxt));
     p += sizeof(ctxt);
-    auto e = p + ctxt.size;
 
     map out_file(outname, "w", ctxt.size);
-    auto end = range_decoder(ctxt, out_file.begin(), out_file.end(), p, e);
+    auto end = block_sorting_decoder(ctxt, out_file.begin(), out_file.end(), p, in_file.end());
+    if (end != out_file.begin() + ctxt.size) {
+      printf("error: %s is corrupt\n", filename);
+      return 1;
+    }
 
-    printf("%ld..%ld bytes\n", long(in_file.size()), long(out_file.size()));*/
+    printf("%ld..%ld bytes\n", long(in_file.size()), long(out_file.size()));
   } else {
     std::string outname = filename;
     outname.append(".rc");
 
-    map out_file(outname, "w", in_file.size() + in_file.size()/0x10000 + 256);
-    auto end = block_sorting_encoder(ctxt, out_file.begin(), out_file.end(), in_file.begin(), in_file.end());
+    size_t blocks = in_file.size() / block_sorting_block_size + 1;
+    map out_file(outname, "w", sizeof(ctxt) + range_block::bound(in_file.size()) + blocks * 4);
+    auto end = block_sorting_encoder(ctxt, out_file.begin() + sizeof(ctxt), out_file.end(), in_file.begin(), in_file.end());
     if (end == out_file.end()) {
       printf("error: compressed file too long\n");
       out_file.truncate(0);
       return 1;
     }
+    memcpy(out_file.data(), &ctxt, sizeof(ctxt));
     out_file.truncate(end - out_file.begin());
     printf("%ld..%ld bytes\n", long(in_file.size()), long(out_file.size()));
   }
 }
-
@@ -1,42 +1,155 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Block sorting (Burrows-Wheeler) coding.
+//
+// Each block of the input is replaced by the byte before each of its
+// suffixes in sorted order, which groups bytes with similar contexts.
+// A move to front pass turns the groups into runs of small numbers which
+// are range coded with range_encode_block.
+//
+// Each block is:
+//
+//   primary     4 bytes  the row of the suffix starting the block
+//   data        a range_block of the move to front output
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef _BLOCK_SORTING_ENCODER_HPP_INCLUDED_
+#define _BLOCK_SORTING_ENCODER_HPP_INCLUDED_
+
 #include "suffix_array.hpp"
+#include "range_encoder.hpp"
+#include "range_decoder.hpp"
 
 #include <cstdint>
 #include <stdio.h>
+#include <string.h>
 #include <array>
+#include <vector>
 #include <algorithm>
 #include <numeric>
 
-template <class Context, class InIter, class OutIter, uint32_t SymBits=8>
+constexpr size_t block_sorting_block_size = 1024 * 900;
+
+// the suffix array of each block is built in workspace, which is reused from block to block.
+template <class Context, class InIter, class OutIter>
 OutIter
-block_sorting_encoder(Context &ctxt, OutIter dest, OutIter destmax, InIter begin, InIter end) {
-  constexpr size_t block_size = 1024 * 900;
+block_sorting_encoder(Context &ctxt, OutIter dest, OutIter destmax, InIter begin, InIter end, suffix_array_workspace<uint32_t> &workspace, size_t block_size = block_sorting_block_size) {
+  ctxt.size = size_t(end - begin);
+  std::vector<uint8_t> mtf;
 
   for (auto start = begin; start < end; start += block_size) {
-    auto last = std::min(end, start + block_size);
+    auto last = start + std::min(size_t(end - start), block_size);
+    size_t size = size_t(last - start);
 
-    suffix_array<uint8_t, uint32_t> sa(start, last);
-    size_t size = sa.size();
-    std::array<uint8_t, 256> mtf;
-    std::iota(mtf.begin(), mtf.end(), 0);
-    std::array<uint8_t, 256> rank;
-    std::iota(rank.begin(), rank.end(), 0);
+    suffix_array<uint8_t, uint32_t> sa(workspace, &*start, &*start + size);
+    std::array<uint8_t, 256> order;
+    std::iota(order.begin(), order.end(), 0);
+    mtf.resize(size);
 
-    for (size_t i = 0; i != size && dest != destmax; ++i) {
+    // row 0 is the empty suffix and the primary row has no byte before it.
+    uint32_t primary = 0;
+    auto out = mtf.begin();
+    for (size_t i = 0; i != size + 1; ++i) {
       auto addr = sa.addr(i);
-      auto chr = addr == 0 ? '$' : start[addr-1];
-      int idx = rank[chr];
-      //printf("ch=%02x idx=%02x\n", chr, idx);
-      *dest++ = idx;
-      for (int i = idx; i > 0; --i) {
-        mtf[i] = mtf[i-1];
-        rank[mtf[i]] = i;
+      if (addr == 0) {
+        primary = uint32_t(i);
+        continue;
       }
-      mtf[0] = chr;
-      rank[chr] = 0;
-      *dest++ = (uint8_t)idx;
+      uint8_t chr = start[addr-1];
+      uint8_t idx = 0;
+      while (order[idx] != chr) ++idx;
+      memmove(order.data() + 1, order.data(), idx);
+      order[0] = chr;
+      *out++ = idx;
+    }
+
+    if (destmax - dest < 4) return destmax;
+    range_block::put32(dest, primary);
+    dest = range_encode_block(dest, destmax, mtf.begin(), mtf.end(), mtf.end());
+    if (dest == destmax) return destmax;
+  }
+
+  return dest;
+}
+
+// share a pool of workspaces with other encoders, limiting the total memory used.
+template <class Context, class InIter, class OutIter>
+OutIter
+block_sorting_encoder(Context &ctxt, OutIter dest, OutIter destmax, InIter begin, InIter end, suffix_array_workspace_pool<> &pool, size_t block_size = block_sorting_block_size) {
+  suffix_array_workspace_pool<>::lease workspace(pool, std::min(size_t(end - begin), block_size));
+  return block_sorting_encoder(ctxt, dest, destmax, begin, end, *workspace, block_size);
+}
+
+// use the pool shared by the encoders in this process.
+template <class Context, class InIter, class OutIter>
+OutIter
+block_sorting_encoder(Context &ctxt, OutIter dest, OutIter destmax, InIter begin, InIter end, size_t block_size = block_sorting_block_size) {
+  return block_sorting_encoder(ctxt, dest, destmax, begin, end, suffix_array_workspace_pool<>::shared(), block_size);
+}
+
+// decode a stream written by block_sorting_encoder. ctxt.size must be set.
+template <class Context, class InIter, class OutIter>
+OutIter
+block_sorting_decoder(Context &ctxt, OutIter dest, OutIter destmax, InIter begin, InIter end) {
+  range_block_decoder decoder;
+  std::vector<uint8_t> mtf;
+  std::vector<uint32_t> next;
+
+  size_t max_size = std::min(ctxt.size, size_t(destmax - dest));
+  auto p = begin;
+  for (size_t offset = 0; offset != max_size; ) {
+    range_block block;
+    auto q = p;
+    if (end - p < 4) { ctxt.error(offset, "bad block header"); break; }
+    q += 4;
+    if (!block.read(q, end) || block.raw_size == 0 || block.raw_size > max_size - offset) { ctxt.error(offset, "bad block header"); break; }
+    uint32_t primary = range_block::get32(p);
+    if (primary == 0 || primary > block.raw_size) { ctxt.error(offset, "bad block header"); break; }
+
+    size_t size = block.raw_size;
+    mtf.resize(size);
+    auto out = mtf.begin();
+    if (!decoder.decode(ctxt, offset, out, mtf.end(), p, end)) break;
+
+    // undo the move to front, counting the bytes.
+    std::array<uint8_t, 256> order;
+    std::iota(order.begin(), order.end(), 0);
+    std::array<uint32_t, 256> counts{};
+    for (auto &m : mtf) {
+      uint8_t idx = m;
+      uint8_t chr = order[idx];
+      memmove(order.data() + 1, order.data(), idx);
+      order[0] = chr;
+      m = chr;
+      counts[chr]++;
+    }
+
+    // next[row] is the row of the suffix one byte earlier in the block.
+    std::array<uint32_t, 256> first;
+    for (uint32_t c = 0, row = 1; c != 256; ++c) {
+      first[c] = row;
+      row += counts[c];
+    }
+    next.resize(size + 1);
+    for (size_t row = 0; row != size + 1; ++row) {
+      if (row == primary) continue;
+      uint8_t chr = mtf[row - (row > primary)];
+      next[row] = first[chr]++;
+    }
+
+    // row 0 is the empty suffix, its byte is the last of the block.
+    uint32_t row = 0;
+    for (size_t i = size; i-- != 0; ) {
+      if (row == primary) { ctxt.error(offset + i, "corrupt input"); return dest; }
+      dest[i] = mtf[row - (row > primary)];
+      row = next[row];
     }
+    dest += size;
+    offset += size;
   }
 
   return dest;
 }
 
+#endif
@@ -0,0 +1,139 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// CRC32C (Castagnoli) checksums.
+//
+// Uses the SSE4.2 crc32 instruction when the cpu has it and falls back
+// to a slice-by-8 table driven version otherwise.
+//
+// crc32c("123456789") == 0xe3069283
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef _CHECKSUM_HPP_INCLUDED_
+#define _CHECKSUM_HPP_INCLUDED_
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <string.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+  #define RC_CRC32C_HW 1
+  #include <nmmintrin.h>
+  #define RC_CRC32C_TARGET __attribute__((target("sse4.2")))
+#elif defined(_MSC_VER) && defined(_M_X64)
+  #define RC_CRC32C_HW 1
+  #include <nmmintrin.h>
+  #include <intrin.h>
+  #define RC_CRC32C_TARGET
+#endif
+
+namespace crc32c_detail {
+  typedef std::array<std::array<uint32_t, 256>, 8> tables_t;
+
+  inline const tables_t &tables() {
+    static const tables_t t = [] {
+      tables_t t;
+      for (uint32_t i = 0; i != 256; ++i) {
+        uint32_t crc = i;
+        for (int j = 0; j != 8; ++j) {
+          crc = (crc >> 1) ^ (0x82f63b78 & (0 - (crc & 1)));
+        }
+        t[0][i] = crc;
+      }
+      for (uint32_t i = 0; i != 256; ++i) {
+        for (int k = 1; k != 8; ++k) {
+          t[k][i] = (t[k-1][i] >> 8) ^ t[0][t[k-1][i] & 0xff];
+        }
+      }
+      return t;
+    }();
+    return t;
+  }
+
+  // slice-by-8: eight table lookups per 64 bits.
+  inline uint32_t software(uint32_t crc, const uint8_t *p, size_t n) {
+    const tables_t &t = tables();
+    for (; n >= 8; n -= 8, p += 8) {
+      uint32_t lo, hi;
+      memcpy(&lo, p, 4);
+      memcpy(&hi, p + 4, 4);
+      lo ^= crc;
+      crc =
+        t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+        t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24]
+      ;
+    }
+    for (; n; --n) {
+      crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+    }
+    return crc;
+  }
+
+  #ifdef RC_CRC32C_HW
+    RC_CRC32C_TARGET inline uint32_t hardware(uint32_t crc, const uint8_t *p, size_t n) {
+      uint64_t acc = crc;
+      for (; n >= 8; n -= 8, p += 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        acc = _mm_crc32_u64(acc, v);
+      }
+      uint32_t c = uint32_t(acc);
+      for (; n; --n) {
+        c = _mm_crc32_u8(c, *p++);
+      }
+      return c;
+    }
+
+    inline bool has_hardware() {
+      #ifdef _MSC_VER
+        static const bool result = [] {
+          int info[4];
+          __cpuid(info, 1);
+          return (info[2] & (1 << 20)) != 0;
+        }();
+        return result;
+      #else
+        static const bool result = __builtin_cpu_supports("sse4.2");
+        return result;
+      #endif
+    }
+  #endif
+}
+
+// crc of n bytes at p. Pass the previous result as crc to continue a checksum.
+inline uint32_t crc32c(const uint8_t *p, size_t n, uint32_t crc = 0) {
+  crc = ~crc;
+  #ifdef RC_CRC32C_HW
+    if (crc32c_detail::has_hardware()) {
+      return ~crc32c_detail::hardware(crc, p, n);
+    }
+  #endif
+  return ~crc32c_detail::software(crc, p, n);
+}
+
+// crc of bytes given one at a time, for iterators that are not pointers.
+class crc32c_stream {
+public:
+  void put(uint8_t byte) {
+    buffer_[size_++] = byte;
+    if (size_ == sizeof(buffer_)) flush();
+  }
+
+  uint32_t value() {
+    flush();
+    return crc_;
+  }
+
+private:
+  void flush() {
+    crc_ = crc32c(buffer_, size_, crc_);
+    size_ = 0;
+  }
+
+  uint8_t buffer_[256];
+  size_t size_ = 0;
+  uint32_t crc_ = 0;
+};
+
+#endif
@@ -0,0 +1,475 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// FM-index over range coded BWT blocks.
+//
+// Counts and finds occurrences of a pattern without decompressing the text.
+//
+// The text is split into blocks and the Burrows-Wheeler transform of each
+// block (the byte before each suffix, in suffix_array order) is cut into
+// sub-blocks of rows. Each sub-block is move to front coded, which turns
+// the runs of the transform into runs of zeros, and range coded with
+// range_encode_block.
+// Alongside the sub-blocks each block keeps:
+//
+//   the number of each byte before each sub-block, so that the number of a
+//   byte in the first i rows needs only the sub-block containing row i;
+//
+//   the text position of every row whose position is a multiple of the
+//   sample rate, with a bitmap of those rows. locate() steps back through
+//   the text from a match until it finds a sampled row.
+//
+// Each block also indexes the first bytes of the following block so that
+// matches crossing the end of a block are found. Matches that start in
+// that overlap belong to the next block and are left out. Patterns longer
+// than the overlap may miss matches that cross a block boundary.
+//
+// An index file is the blocks, a directory of their offsets and a trailer:
+//
+//   directory offset   8 bytes
+//   number of blocks   4 bytes
+//   overlap            4 bytes
+//   text size          8 bytes
+//   signature          8 bytes "rcfmidx"
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef _FM_INDEX_HPP_INCLUDED_
+#define _FM_INDEX_HPP_INCLUDED_
+
+#include <cstdint>
+#include <string.h>
+#include <array>
+#include <vector>
+#include <algorithm>
+#include <iterator>
+
+#include "suffix_array.hpp"
+#include "range_encoder.hpp"
+#include "range_decoder.hpp"
+
+#ifdef _MSC_VER
+  #include <intrin.h>
+#endif
+
+class fm_index {
+public:
+  static const size_t default_block_size = 0x400000;
+  static const size_t default_overlap = 0x400;
+  static const uint32_t max_rows_per_sub = 0x8000;
+
+  struct options {
+    size_t block_size = default_block_size;
+    size_t overlap = default_overlap;
+    // rows of the transform in each range coded sub-block, at most max_rows_per_sub.
+    uint32_t rows_per_sub = 0x4000;
+    // text positions that are a multiple of this are sampled.
+    uint32_t sample_rate = 64;
+  };
+
+  // index [begin, end) and append the index to out.
+  static void build(std::vector<uint8_t> &out, const uint8_t *begin, const uint8_t *end) {
+    build(out, begin, end, options());
+  }
+
+  static void build(std::vector<uint8_t> &out, const uint8_t *begin, const uint8_t *end, const options &opts) {
+    size_t size = size_t(end - begin);
+    size_t overlap = std::min(opts.overlap, opts.block_size);
+    size_t first = out.size();
+    std::vector<uint64_t> offsets;
+    suffix_array_workspace_pool<>::lease workspace(suffix_array_workspace_pool<>::shared(), std::min(size, opts.block_size + overlap));
+
+    for (size_t start = 0; start < size; start += opts.block_size) {
+      size_t own = std::min(size - start, opts.block_size);
+      size_t ext = std::min(size - start, own + overlap);
+      offsets.push_back(out.size() - first);
+      build_block(out, *workspace, begin + start, own, ext, opts);
+    }
+
+    uint64_t directory = out.size() - first;
+    for (uint64_t offset : offsets) put64(out, offset);
+    put64(out, directory);
+    put32(out, uint32_t(offsets.size()));
+    put32(out, uint32_t(overlap));
+    put64(out, size);
+    out.insert(out.end(), signature(), signature() + 8);
+  }
+
+  // use the index in [begin, end), which must stay valid.
+  bool open(const uint8_t *begin, const uint8_t *end) {
+    blocks_.clear();
+    cache_.assign(cache_size, cached_sub());
+    if (size_t(end - begin) < trailer_size) return false;
+    const uint8_t *t = end - trailer_size;
+    if (memcmp(t + 24, signature(), 8)) return false;
+    uint64_t directory = load64(t);
+    uint32_t num_blocks = load32(t + 8);
+    overlap_ = load32(t + 12);
+    size_ = load64(t + 16);
+    if (directory > size_t(t - begin) || size_t(t - begin) - directory != num_blocks * 8ull) return false;
+
+    uint64_t start = 0;
+    for (uint32_t i = 0; i != num_blocks; ++i) {
+      uint64_t offset = load64(begin + directory + i * 8);
+      uint64_t next = i + 1 == num_blocks ? directory : load64(begin + directory + i * 8 + 8);
+      block b;
+      if (offset > next || next > directory || !b.open(begin + offset, begin + next)) return false;
+      b.start = start;
+      start += b.own_size;
+      blocks_.push_back(b);
+    }
+    return start == size_;
+  }
+
+  uint64_t size() const { return size_; }
+  size_t overlap() const { return overlap_; }
+
+  // the number of occurrences of pattern in the text.
+  template <class Context>
+  uint64_t count(Context &ctxt, const uint8_t *pattern, size_t length) {
+    uint64_t result = 0;
+    for (size_t i = 0; i != blocks_.size(); ++i) {
+      uint32_t lo, hi;
+      if (!search(ctxt, i, pattern, length, lo, hi)) continue;
+      result += hi - lo;
+      // matches that start in the overlap are counted by the next block.
+      const block &b = blocks_[i];
+      result -= b.overlap_before(hi) - b.overlap_before(lo);
+    }
+    return result;
+  }
+
+  // append the text positions of the occurrences of pattern to positions, in order.
+  template <class Context>
+  void locate(Context &ctxt, std::vector<uint64_t> &positions, const uint8_t *pattern, size_t length) {
+    size_t first = positions.size();
+    for (size_t i = 0; i != blocks_.size(); ++i) {
+      uint32_t lo, hi;
+      if (!search(ctxt, i, pattern, length, lo, hi)) continue;
+      const block &b = blocks_[i];
+      for (uint32_t row = lo; row != hi; ++row) {
+        uint32_t pos;
+        if (!position(ctxt, i, row, pos)) break;
+        if (pos < b.own_size) positions.push_back(b.start + pos);
+      }
+    }
+    std::sort(positions.begin() + first, positions.end());
+  }
+
+private:
+  static const char *signature() { return "rcfmidx"; }
+  static const size_t trailer_size = 32;
+  static const size_t block_header_size = 7 * 4;
+  // decoded sub-blocks kept for locate(), which visits the same sub-blocks many times.
+  static const size_t cache_size = 256;
+
+  // one block of the index, pointing into the file.
+  //
+  //   own size, size, primary row, rows per sub-block, sample rate,
+  //   overlap rows, sampled rows                               7 x 4 bytes
+  //   first row of each byte                                   256 x 4 bytes
+  //   count of each byte before each sub-block                 256 x 4 bytes each
+  //   offset of each sub-block and the end                     4 bytes each
+  //   sampled row bitmap                                       8 bytes per 64 rows
+  //   sampled rows before every eighth bitmap word             4 bytes per 512 rows
+  //   text position of each sampled row                        4 bytes each
+  //   rows of the suffixes starting in the overlap, sorted     4 bytes each
+  //   range coded sub-blocks
+  struct block {
+    uint64_t start = 0;
+    uint32_t own_size, size, primary, rows_per_sub, sample_rate, num_overlap, num_sampled;
+    uint32_t num_rows, num_subs, num_words, num_ranks;
+    const uint8_t *first_row, *counts, *sub_offsets, *bitmap, *bitmap_ranks, *samples, *overlap_rows, *subs, *end;
+
+    bool open(const uint8_t *p, const uint8_t *e) {
+      if (size_t(e - p) < block_header_size) return false;
+      own_size = load32(p); size = load32(p + 4); primary = load32(p + 8);
+      rows_per_sub = load32(p + 12); sample_rate = load32(p + 16);
+      num_overlap = load32(p + 20); num_sampled = load32(p + 24);
+      if (own_size > size || primary > size || size == ~(uint32_t)0 || !rows_per_sub || rows_per_sub > max_rows_per_sub || !sample_rate) return false;
+      num_rows = size + 1;
+      num_subs = uint32_t((uint64_t(num_rows) + rows_per_sub - 1) / rows_per_sub);
+      num_words = (num_rows + 63) / 64;
+      num_ranks = (num_words + 7) / 8;
+
+      uint64_t need = block_header_size + 256 * 4 + uint64_t(num_subs) * 256 * 4 + (num_subs + 1) * 4ull +
+        num_words * 8ull + num_ranks * 4ull + num_sampled * 4ull + num_overlap * 4ull;
+      if (need > uint64_t(e - p)) return false;
+      first_row = p + block_header_size;
+      counts = first_row + 256 * 4;
+      sub_offsets = counts + size_t(num_subs) * 256 * 4;
+      bitmap = sub_offsets + (num_subs + 1) * 4;
+      bitmap_ranks = bitmap + num_words * 8;
+      samples = bitmap_ranks + num_ranks * 4;
+      overlap_rows = samples + num_sampled * 4;
+      subs = overlap_rows + num_overlap * 4;
+      end = e;
+      return load32(sub_offsets + num_subs * 4) <= size_t(e - subs);
+    }
+
+    // the number of sampled rows before row.
+    uint32_t sampled_before(uint32_t row) const {
+      uint32_t word = row / 64;
+      uint32_t result = load32(bitmap_ranks + (word / 8) * 4);
+      for (uint32_t i = word & ~7u; i != word; ++i) result += popcount(load64(bitmap + i * 8));
+      uint64_t mask = ((uint64_t)1 << (row % 64)) - 1;
+      return result + popcount(load64(bitmap + word * 8) & mask);
+    }
+
+    // the number of suffixes starting in the overlap with rows before row.
+    uint32_t overlap_before(uint32_t row) const {
+      uint32_t lo = 0, hi = num_overlap;
+      while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (load32(overlap_rows + mid * 4) < row) lo = mid + 1; else hi = mid;
+      }
+      return lo;
+    }
+
+    bool sampled(uint32_t row) const {
+      return (load64(bitmap + (row / 64) * 8) >> (row % 64)) & 1;
+    }
+  };
+
+  // a decoded sub-block of the transform with the number of each byte
+  // before every rank_interval rows, so that a rank query scans few rows.
+  static const uint32_t rank_interval = 256;
+
+  struct cached_sub {
+    size_t block = ~(size_t)0;
+    uint32_t sub = 0;
+    std::vector<uint8_t> rows;
+    std::vector<uint16_t> ranks;
+  };
+
+  static void build_block(std::vector<uint8_t> &out, suffix_array_workspace<uint32_t> &workspace, const uint8_t *text, size_t own, size_t size, const options &opts) {
+    suffix_array<uint8_t, uint32_t> sa(workspace, text, text + size);
+    uint32_t num_rows = uint32_t(size + 1);
+    uint32_t rows_per_sub = std::min(opts.rows_per_sub, uint32_t(max_rows_per_sub));
+    uint32_t num_subs = (num_rows + rows_per_sub - 1) / rows_per_sub;
+    uint32_t num_words = (num_rows + 63) / 64;
+
+    // the transform. Row 0 is the empty suffix, the end of the text is stored as a zero at the primary row.
+    std::vector<uint8_t> bwt(num_rows);
+    std::vector<uint64_t> bitmap(num_words);
+    std::vector<uint32_t> samples;
+    uint32_t primary = 0;
+    for (uint32_t row = 0; row != num_rows; ++row) {
+      uint32_t addr = sa.addr(row);
+      if (addr == 0) primary = row;
+      bwt[row] = addr == 0 ? 0 : text[addr - 1];
+      if (addr % opts.sample_rate == 0) {
+        bitmap[row / 64] |= (uint64_t)1 << (row % 64);
+        samples.push_back(addr);
+      }
+    }
+
+    std::vector<uint32_t> overlap_rows;
+    for (size_t addr = own; addr != size; ++addr) {
+      overlap_rows.push_back(sa.rank(addr));
+    }
+    std::sort(overlap_rows.begin(), overlap_rows.end());
+
+    put32(out, uint32_t(own));
+    put32(out, uint32_t(size));
+    put32(out, primary);
+    put32(out, rows_per_sub);
+    put32(out, opts.sample_rate);
+    put32(out, uint32_t(overlap_rows.size()));
+    put32(out, uint32_t(samples.size()));
+
+    std::array<uint32_t, 256> totals{};
+    for (uint32_t row = 0; row != num_rows; ++row) {
+      if (row != primary) totals[bwt[row]]++;
+    }
+    for (uint32_t c = 0, first = 1; c != 256; ++c) {
+      put32(out, first);
+      first += totals[c];
+    }
+
+    // counts before each sub-block, then the sub-blocks themselves.
+    std::array<uint32_t, 256> counts{};
+    std::vector<uint8_t> subs;
+    std::vector<uint8_t> mtf;
+    std::vector<uint32_t> sub_offsets;
+    for (uint32_t sub = 0; sub != num_subs; ++sub) {
+      for (uint32_t c = 0; c != 256; ++c) put32(out, counts[c]);
+      uint32_t row = sub * rows_per_sub;
+      uint32_t row_end = std::min(num_rows, row + rows_per_sub);
+      for (uint32_t r = row; r != row_end; ++r) {
+        if (r != primary) counts[bwt[r]]++;
+      }
+
+      sub_offsets.push_back(uint32_t(subs.size()));
+      size_t used = subs.size();
+      subs.resize(used + range_block::bound(row_end - row));
+      mtf.assign(bwt.data() + row, bwt.data() + row_end);
+      move_to_front(mtf.data(), mtf.size());
+      const uint8_t *src = mtf.data();
+      uint8_t *dest = subs.data() + used;
+      uint8_t *dest_end = range_encode_block(dest, subs.data() + subs.size(), src, src + (row_end - row), src + (row_end - row));
+      subs.resize(used + (dest_end - dest));
+    }
+    sub_offsets.push_back(uint32_t(subs.size()));
+    for (uint32_t offset : sub_offsets) put32(out, offset);
+
+    for (uint64_t word : bitmap) put64(out, word);
+    for (uint32_t i = 0, rank = 0; i != num_words; ++i) {
+      if (i % 8 == 0) put32(out, rank);
+      rank += popcount(bitmap[i]);
+    }
+    for (uint32_t sample : samples) put32(out, sample);
+    for (uint32_t row : overlap_rows) put32(out, row);
+    out.insert(out.end(), subs.begin(), subs.end());
+  }
+
+  // replace each byte by its position in a list of recently used bytes.
+  static void move_to_front(uint8_t *p, size_t size) {
+    std::array<uint8_t, 256> order;
+    for (uint32_t c = 0; c != 256; ++c) order[c] = uint8_t(c);
+    for (size_t i = 0; i != size; ++i) {
+      uint8_t chr = p[i];
+      uint8_t idx = 0;
+      while (order[idx] != chr) ++idx;
+      memmove(order.data() + 1, order.data(), idx);
+      order[0] = chr;
+      p[i] = idx;
+    }
+  }
+
+  static void undo_move_to_front(uint8_t *p, size_t size) {
+    std::array<uint8_t, 256> order;
+    for (uint32_t c = 0; c != 256; ++c) order[c] = uint8_t(c);
+    for (size_t i = 0; i != size; ++i) {
+      uint8_t idx = p[i];
+      uint8_t chr = order[idx];
+      memmove(order.data() + 1, order.data(), idx);
+      order[0] = chr;
+      p[i] = chr;
+    }
+  }
+
+  // sub-block sub of block b, decoded once and kept in the cache.
+  template <class Context>
+  const cached_sub *rows(Context &ctxt, size_t i, uint32_t sub) {
+    cached_sub &entry = cache_[(i * 31 + sub) % cache_size];
+    if (entry.block == i && entry.sub == sub) return &entry;
+
+    const block &b = blocks_[i];
+    entry.block = ~(size_t)0;
+    entry.rows.resize(std::min(b.rows_per_sub, b.num_rows - sub * b.rows_per_sub));
+    const uint8_t *p = b.subs + load32(b.sub_offsets + sub * 4);
+    const uint8_t *end = b.subs + load32(b.sub_offsets + sub * 4 + 4);
+    uint8_t *dest = entry.rows.data();
+    if (p > end || end > b.end || !decoder_.decode(ctxt, size_t(sub) * b.rows_per_sub, dest, dest + entry.rows.size(), p, end) ||
+      dest != entry.rows.data() + entry.rows.size()) {
+      return nullptr;
+    }
+    undo_move_to_front(entry.rows.data(), entry.rows.size());
+
+    size_t num_ranks = entry.rows.size() / rank_interval + 1;
+    entry.ranks.assign(num_ranks * 256, 0);
+    for (size_t k = 1; k != num_ranks; ++k) {
+      uint16_t *ranks = entry.ranks.data() + k * 256;
+      std::copy(ranks - 256, ranks, ranks);
+      for (size_t row = (k - 1) * rank_interval; row != k * rank_interval; ++row) ranks[entry.rows[row]]++;
+    }
+    entry.block = i;
+    entry.sub = sub;
+    return &entry;
+  }
+
+  // the number of c in the first row rows of the transform.
+  template <class Context>
+  bool occurrences(Context &ctxt, size_t i, uint8_t c, uint32_t row, uint32_t &result) {
+    const block &b = blocks_[i];
+    if (row == b.num_rows) {
+      result = (c == 255 ? b.num_rows : load32(b.first_row + c * 4 + 4)) - load32(b.first_row + c * 4);
+      return true;
+    }
+    uint32_t sub = row / b.rows_per_sub;
+    result = load32(b.counts + (size_t(sub) * 256 + c) * 4);
+    uint32_t sub_row = sub * b.rows_per_sub;
+    if (row == sub_row) return true;
+    const cached_sub *entry = rows(ctxt, i, sub);
+    if (!entry) return false;
+    uint32_t k = (row - sub_row) / rank_interval;
+    const uint8_t *r = entry->rows.data();
+    result += entry->ranks[k * 256 + c];
+    result += uint32_t(std::count(r + k * rank_interval, r + (row - sub_row), c));
+    if (c == 0 && b.primary >= sub_row && b.primary < row) result--;
+    return true;
+  }
+
+  // backward search: the rows [lo, hi) of the suffixes of block i starting with pattern.
+  template <class Context>
+  bool search(Context &ctxt, size_t i, const uint8_t *pattern, size_t length, uint32_t &lo, uint32_t &hi) {
+    const block &b = blocks_[i];
+    lo = 0;
+    hi = b.num_rows;
+    for (size_t k = length; k-- != 0 && lo < hi; ) {
+      uint8_t c = pattern[k];
+      uint32_t first = load32(b.first_row + c * 4);
+      uint32_t lo_count, hi_count;
+      if (!occurrences(ctxt, i, c, lo, lo_count) || !occurrences(ctxt, i, c, hi, hi_count)) return false;
+      lo = first + lo_count;
+      hi = first + hi_count;
+      if (hi > b.num_rows) { ctxt.error(0, "corrupt index"); return false; }
+    }
+    return lo < hi;
+  }
+
+  // the text position of a row, found by stepping back to a sampled row.
+  template <class Context>
+  bool position(Context &ctxt, size_t i, uint32_t row, uint32_t &pos) {
+    const block &b = blocks_[i];
+    uint32_t steps = 0;
+    while (!b.sampled(row)) {
+      if (row == b.primary || steps++ == b.sample_rate) { ctxt.error(row, "corrupt index"); return false; }
+      const cached_sub *entry = rows(ctxt, i, row / b.rows_per_sub);
+      if (!entry) return false;
+      uint8_t c = entry->rows[row % b.rows_per_sub];
+      uint32_t count;
+      if (!occurrences(ctxt, i, c, row, count)) return false;
+      row = load32(b.first_row + c * 4) + count;
+      if (row >= b.num_rows) { ctxt.error(row, "corrupt index"); return false; }
+    }
+    uint32_t sample = b.sampled_before(row);
+    if (sample >= b.num_sampled) { ctxt.error(row, "corrupt index"); return false; }
+    pos = load32(b.samples + sample * 4) + steps;
+    return true;
+  }
+
+  static uint32_t popcount(uint64_t value) {
+    #ifdef _MSC_VER
+      return uint32_t(__popcnt64(value));
+    #else
+      return uint32_t(__builtin_popcountll(value));
+    #endif
+  }
+
+  static void put32(std::vector<uint8_t> &out, uint32_t value) {
+    auto dest = std::back_inserter(out);
+    range_block::put32(dest, value);
+  }
+
+  static void put64(std::vector<uint8_t> &out, uint64_t value) {
+    put32(out, uint32_t(value));
+    put32(out, uint32_t(value >> 32));
+  }
+
+  static uint32_t load32(const uint8_t *p) {
+    return range_block::get32(p);
+  }
+
+  static uint64_t load64(const uint8_t *p) {
+    return load32(p) | (uint64_t)load32(p + 4) << 32;
+  }
+
+  uint64_t size_ = 0;
+  size_t overlap_ = 0;
+  std::vector<block> blocks_;
+  std::vector<cached_sub> cache_;
+  range_block_decoder decoder_;
+};
+
+#endif
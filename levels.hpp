@@ -0,0 +1,169 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Compression levels.
+//
+// Each level is a coding method and its parameters, from fastest to
+// best compression on typical text:
+//
+//   1  order 0 range coding in 128KB blocks
+//   2  order 1 range coding with a model trained on the input and sent
+//      with the data
+//   3  block sorting in 900KB blocks
+//   4  block sorting in 4MB blocks
+//
+// level_tune() codes a sample of the input with each level and picks the
+// level giving the smallest output that still codes at the target speed
+// on this machine.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef _LEVELS_HPP_INCLUDED_
+#define _LEVELS_HPP_INCLUDED_
+
+#include <cstdint>
+#include <stdio.h>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+
+#include "range_encoder.hpp"
+#include "range_decoder.hpp"
+#include "model.hpp"
+#include "block_sorting_encoder.hpp"
+
+struct coding_level {
+  enum : uint8_t { order0, order1, block_sorting };
+
+  uint8_t method;
+  size_t block_size;
+  const char *name;
+
+  static const int min_level = 1;
+  static const int max_level = 4;
+  static const int default_level = 1;
+
+  static const coding_level &get(int level) {
+    static const coding_level levels[] = {
+      { order0, range_block::default_size, "order 0" },
+      { order1, 0, "order 1" },
+      { block_sorting, block_sorting_block_size, "block sorting 900KB" },
+      { block_sorting, 0x400000, "block sorting 4MB" },
+    };
+    return levels[level - min_level];
+  }
+
+  // largest possible output for size bytes of input.
+  size_t bound(size_t size) const {
+    switch (method) {
+      case order1: return model::max_compact_bytes + model_message_bound(size);
+      case block_sorting: return range_block::bound(size, block_size) + (size / block_size + 1) * 4;
+      default: return range_block::bound(size, block_size);
+    }
+  }
+};
+
+// order 1 coding with a model trained on the input, which is written first.
+// model_encoder adds a checksum of the input.
+template <class Context>
+uint8_t *
+order1_encoder(Context &ctxt, uint8_t *dest, uint8_t *destmax, const uint8_t *begin, const uint8_t *end) {
+  model m(0, 1);
+  m.train(begin, end);
+  m.finish(false);
+  if (size_t(destmax - dest) < m.compact_bytes()) return destmax;
+  dest = m.write_compact(dest);
+  return model_encoder(ctxt, m, dest, destmax, begin, end);
+}
+
+template <class Context>
+uint8_t *
+order1_decoder(Context &ctxt, uint8_t *dest, uint8_t *destmax, const uint8_t *begin, const uint8_t *end) {
+  model m;
+  auto p = begin;
+  if (!m.read_compact(p, end)) {
+    ctxt.error(0, "bad model");
+    return dest;
+  }
+  size_t size = ctxt.size;
+  auto result = model_decoder(ctxt, m, dest, destmax, p, end);
+  if (ctxt.size != size) {
+    ctxt.error(0, "bad message header");
+    return dest;
+  }
+  return result;
+}
+
+// code [begin, end) at a level. Returns destmax if there is not enough room.
+template <class Context>
+uint8_t *
+level_encoder(Context &ctxt, const coding_level &level, uint8_t *dest, uint8_t *destmax, const uint8_t *begin, const uint8_t *end) {
+  switch (level.method) {
+    case coding_level::order1: return order1_encoder(ctxt, dest, destmax, begin, end);
+    case coding_level::block_sorting: return block_sorting_encoder(ctxt, dest, destmax, begin, end, level.block_size);
+    default: return range_encoder(ctxt, dest, destmax, begin, end, level.block_size);
+  }
+}
+
+// decode a stream coded with method. ctxt.size must be set.
+template <class Context>
+uint8_t *
+level_decoder(Context &ctxt, uint8_t method, uint8_t *dest, uint8_t *destmax, const uint8_t *begin, const uint8_t *end) {
+  switch (method) {
+    case coding_level::order1: return order1_decoder(ctxt, dest, destmax, begin, end);
+    case coding_level::block_sorting: return block_sorting_decoder(ctxt, dest, destmax, begin, end);
+    default: return range_decoder(ctxt, dest, destmax, begin, end);
+  }
+}
+
+// the level with the smallest output on a sample of [begin, end) that codes
+// at no less than target_mbps, or level 1 if none is fast enough.
+// methods is a bit mask of the methods that may be used.
+//
+// The levels cost more as they go up so the search stops at the first
+// level that is too slow rather than timing the slowest levels too.
+inline int level_tune(double target_mbps, const uint8_t *begin, const uint8_t *end, uint32_t methods = ~0u, bool verbose = false) {
+  // up to eight evenly spaced slices of the input.
+  static const size_t max_sample = 0x400000;
+  static const size_t num_slices = 8;
+  size_t size = size_t(end - begin);
+  std::vector<uint8_t> sample;
+  if (size <= max_sample) {
+    sample.assign(begin, end);
+  } else {
+    size_t slice = max_sample / num_slices;
+    for (size_t i = 0; i != num_slices; ++i) {
+      const uint8_t *p = begin + (size - slice) * i / (num_slices - 1);
+      sample.insert(sample.end(), p, p + slice);
+    }
+  }
+
+  struct tune_context {
+    size_t size;
+    void error(size_t, const char *) {}
+  } ctxt;
+
+  int best = 0;
+  size_t best_size = 0;
+  std::vector<uint8_t> out;
+  for (int level = coding_level::min_level; level <= coding_level::max_level; ++level) {
+    const coding_level &l = coding_level::get(level);
+    if (!(methods >> l.method & 1)) continue;
+    out.resize(l.bound(sample.size()));
+    auto t0 = std::chrono::high_resolution_clock::now();
+    uint8_t *out_end = level_encoder(ctxt, l, out.data(), out.data() + out.size(), sample.data(), sample.data() + sample.size());
+    auto t1 = std::chrono::high_resolution_clock::now();
+    double seconds = std::max(1e-6, std::chrono::duration<double>(t1 - t0).count());
+    double mbps = sample.size() / seconds / 1e6;
+    size_t coded = size_t(out_end - out.data());
+    if (verbose) printf("level %d (%s): %ld..%ld bytes at %.1f MB/s\n", level, l.name, long(sample.size()), long(coded), mbps);
+
+    if (mbps < target_mbps) break;
+    if (out_end != out.data() + out.size() && (!best || coded < best_size)) {
+      best = level;
+      best_size = coded;
+    }
+  }
+  return best ? best : coding_level::min_level;
+}
+
+#endif
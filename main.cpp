@@ -2,51 +2,239 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
 
 #include "range_encoder.hpp"
 #include "range_decoder.hpp"
+#include "model.hpp"
+#include "parallel_coder.hpp"
+#include "archive.hpp"
+#include "plane_transform.hpp"
+#include "levels.hpp"
+#include "patch.hpp"
 
 #include "map.hpp"
 
 struct context {
   char sig[8] = "rcoder";
   size_t size;
-  std::array<uint32_t, 256+1> starts;
+  plane_params planes;
+  uint8_t method = coding_level::order0;
   static const uint32_t mask = 255;
 
   void error(size_t offset, const char *msg) {
-    printf("%s @ %lx", msg, long(offset));
+    printf("%s @ %lx\n", msg, long(offset));
   }
 };
 
+int encode_with_model(context &ctxt, const model &m, const map &in_file, const char *filename) {
+  std::string outname = filename;
+  outname.append(".rc");
+
+  map out_file(outname, "w", model_message_bound(in_file.size()));
+  auto end = model_encoder(ctxt, m, out_file.begin(), out_file.end(), in_file.begin(), in_file.end());
+  if (end == out_file.end()) {
+    printf("error: compressed file too long\n");
+    out_file.truncate(0);
+    return 1;
+  }
+  out_file.truncate(end - out_file.begin());
+  printf("%ld..%ld bytes\n", long(in_file.size()), long(out_file.size()));
+  return 0;
+}
+
+int decode_with_model(context &ctxt, const model &m, const map &in_file, const char *filename) {
+  std::string outname = filename;
+  outname.append(".dec");
+
+  uint32_t id;
+  size_t size;
+  if (!model_message_header(in_file.begin(), in_file.end(), id, size) || id != m.id()) {
+    printf("error: %s was not coded with model %d\n", filename, int(m.id()));
+    return 1;
+  }
+
+  map out_file(outname, "w", size);
+  auto end = model_decoder(ctxt, m, out_file.begin(), out_file.end(), in_file.begin(), in_file.end());
+  if (end != out_file.begin() + size) {
+    printf("error: %s is corrupt\n", filename);
+    return 1;
+  }
+  printf("%ld..%ld bytes\n", long(in_file.size()), long(out_file.size()));
+  return 0;
+}
+
+// code a file as a patch against a reference or apply a patch.
+int run_patch(context &ctxt, bool decode, const char *reference_name, const map &in_file, const char *filename) {
+  map ref_file(reference_name, "r");
+  patch pt(ref_file.begin(), ref_file.end());
+
+  std::string outname = filename;
+  if (decode) {
+    outname.append(".dec");
+    size_t size;
+    if (!patch::header(in_file.begin(), in_file.end(), size)) {
+      printf("error: %s is not a patch\n", filename);
+      return 1;
+    }
+    map out_file(outname, "w", size);
+    auto end = pt.apply(ctxt, out_file.begin(), out_file.end(), in_file.begin(), in_file.end());
+    if (end != out_file.begin() + size) {
+      printf("error: %s does not apply to %s\n", filename, reference_name);
+      out_file.truncate(0);
+      return 1;
+    }
+  } else {
+    outname.append(".rc");
+    map out_file(outname, "w", patch::bound(in_file.size()));
+    auto end = pt.encode(ctxt, out_file.begin(), out_file.end(), in_file.begin(), in_file.end());
+    if (end == out_file.end()) {
+      printf("error: compressed file too long\n");
+      out_file.truncate(0);
+      return 1;
+    }
+    out_file.truncate(end - out_file.begin());
+    printf("%ld..%ld bytes\n", long(in_file.size()), long(out_file.size()));
+  }
+  return 0;
+}
+
 int usage() {
-  printf("usage: rcoder [-d] filename\n");
+  printf("usage: rcoder [-d] [-1..-4 | --target-mbps mbps] [-m model] [-t threads] [-n numa_nodes] [-s stride[,width[,sub|xor]]] filename\n");
+  printf("       rcoder [-d] -r reference filename\n");
+  printf("       rcoder -a archive [-t threads] paths...\n");
+  printf("       rcoder -x archive [-t threads] [path]\n");
+  printf("       rcoder -l archive\n");
   return 1;
 }
 
+int run_archive(context &ctxt, char mode, const char *archive_name, const std::vector<char *> &paths, const numa_topology &topology, int threads) {
+  archive arc;
+  if (mode == 'a') {
+    for (auto path : paths) {
+      if (!arc.add(path)) {
+        printf("error: could not read %s\n", path);
+        return 1;
+      }
+    }
+    if (!arc.create(ctxt, archive_name, topology, threads)) {
+      printf("error: could not write %s\n", archive_name);
+      return 1;
+    }
+    printf("%ld files\n", long(arc.entries().size()));
+    return 0;
+  }
+
+  if (!arc.open(ctxt, archive_name)) {
+    printf("error: %s is not an archive or is corrupt\n", archive_name);
+    return 1;
+  }
+  if (mode == 'l') {
+    for (auto &e : arc.entries()) {
+      printf("%12ld %s\n", long(e.size), e.path.c_str());
+    }
+    return 0;
+  }
+  if (paths.size() > 1) {
+    return usage();
+  }
+  if (!arc.extract(ctxt, paths.empty() ? nullptr : paths[0], topology, threads)) {
+    printf("error: could not extract %s\n", paths.empty() ? "archive" : paths[0]);
+    return 1;
+  }
+  return 0;
+}
+
 int main(int argc, char **argv) {
   bool decode = false;
   char *filename = nullptr;
+  char *model_name = nullptr;
+  char *reference_name = nullptr;
+  int threads = -1;
+  int numa_nodes = 0;
+  char archive_mode = 0;
+  char *archive_name = nullptr;
+  std::vector<char *> paths;
+  plane_params planes;
+  int level = 0;
+  double target_mbps = 0;
 
   for (int i = 1; i < argc; ++i) {
     char *arg = argv[i];
     if (arg[0] == '-') {
       if (!strcmp(arg+1, "d")) {
         decode = true;
+      } else if (arg[1] >= '0' + coding_level::min_level && arg[1] <= '0' + coding_level::max_level && !arg[2]) {
+        level = arg[1] - '0';
+      } else if (!strcmp(arg+1, "-target-mbps") && i + 1 < argc) {
+        target_mbps = atof(argv[++i]);
+        if (target_mbps <= 0) return usage();
+      } else if (!strcmp(arg+1, "m") && i + 1 < argc) {
+        model_name = argv[++i];
+      } else if (!strcmp(arg+1, "r") && i + 1 < argc) {
+        reference_name = argv[++i];
+      } else if (!strcmp(arg+1, "t") && i + 1 < argc) {
+        threads = atoi(argv[++i]);
+      } else if (!strcmp(arg+1, "n") && i + 1 < argc) {
+        numa_nodes = atoi(argv[++i]);
+      } else if (!strcmp(arg+1, "s") && i + 1 < argc) {
+        // eg. -s 24,8,sub for records of three float64 values.
+        char *p = argv[++i];
+        planes.stride = (uint32_t)strtoul(p, &p, 0);
+        planes.width = uint8_t(*p == ',' ? strtoul(p + 1, &p, 0) : 1);
+        if (*p == ',') {
+          planes.delta = !strcmp(p + 1, "sub") ? plane_params::sub : !strcmp(p + 1, "xor") ? plane_params::xor_ : 0xff;
+        } else if (*p) {
+          return usage();
+        }
+        if (!planes.valid()) return usage();
+      } else if (strchr("axl", arg[1]) && arg[1] && !arg[2] && i + 1 < argc) {
+        archive_mode = arg[1];
+        archive_name = argv[++i];
       } else {
         return usage();
       }
     } else {
-      if (filename != nullptr) {
-        return usage();
-      }
-      filename = arg;
+      paths.push_back(arg);
     }
   }
 
-  map in_file(filename, "r");
+  if (archive_mode) {
+    numa_topology topology = numa_nodes ? numa_topology::fake(numa_nodes) : numa_topology::detect();
+    if (threads <= 0) threads = int(topology.num_cpus());
+    context ctxt;
+    return run_archive(ctxt, archive_mode, archive_name, paths, topology, threads);
+  }
+
+  // order 1 streams can not be split into planes and patches have no options.
+  bool other_options = model_name || planes.stride || level || target_mbps;
+  if (paths.size() != 1 || (model_name && planes.stride) || (level && target_mbps) || (planes.stride && level == 2) || (reference_name && other_options)) {
+    return usage();
+  }
+  filename = paths[0];
+  if (threads < 0) threads = 1;
+
+  // in parallel mode the workers fault in the input on their own nodes.
+  bool parallel = threads != 1 || numa_nodes != 0;
+  map in_file(filename, parallel ? "rl" : "r");
+
+  numa_topology topology = numa_nodes ? numa_topology::fake(numa_nodes) : numa_topology::detect();
+  if (threads <= 0) threads = int(topology.num_cpus());
 
   context ctxt;
+  if (model_name) {
+    model m;
+    if (!m.load(model_name)) {
+      printf("error: could not load model %s\n", model_name);
+      return 1;
+    }
+    return decode ? decode_with_model(ctxt, m, in_file, filename) : encode_with_model(ctxt, m, in_file, filename);
+  }
+
+  if (reference_name) {
+    return run_patch(ctxt, decode, reference_name, in_file, filename);
+  }
+
   if (decode) {
     std::string outname = filename;
     size_t f = outname.rfind(".rc");
@@ -57,20 +245,77 @@ int main(int argc, char **argv) {
     }
 
     auto p = in_file.begin();
+    if (in_file.size() < sizeof(ctxt) || memcmp(p, ctxt.sig, sizeof(ctxt.sig))) {
+      printf("error: %s is not an rcoder file\n", filename);
+      return 1;
+    }
     memcpy(&ctxt, p, sizeof(ctxt));
     p += sizeof(ctxt);
-    auto e = p + ctxt.size;
+    auto e = in_file.end();
+    if (!ctxt.planes.valid() || ctxt.planes.stride > ctxt.size || ctxt.method > coding_level::block_sorting) {
+      printf("error: %s is corrupt\n", filename);
+      return 1;
+    }
 
+    // planes are decoded to a buffer and joined into the output.
     map out_file(outname, "w", ctxt.size);
-    auto end = range_decoder(ctxt, out_file.begin(), out_file.end(), p, e);
+    std::vector<uint8_t> planes;
+    uint8_t *dest = out_file.begin();
+    if (ctxt.planes.stride) {
+      planes.resize(ctxt.size);
+      dest = planes.data();
+    }
+    auto end = parallel && ctxt.method == coding_level::order0 ?
+      parallel_range_decoder(ctxt, topology, threads, dest, dest + ctxt.size, p, e) :
+      level_decoder(ctxt, ctxt.method, dest, dest + ctxt.size, p, e)
+    ;
+    if (end != dest + ctxt.size) {
+      printf("error: %s is corrupt\n", filename);
+      return 1;
+    }
+    if (ctxt.planes.stride) {
+      plane_join(ctxt.planes, out_file.begin(), planes.data(), ctxt.size);
+    }
 
     printf("%ld..%ld bytes\n", long(in_file.size()), long(out_file.size()));
   } else {
     std::string outname = filename;
     outname.append(".rc");
 
-    map out_file(outname, "w", in_file.size());
-    auto end = range_encoder(ctxt, out_file.begin() + sizeof(ctxt), out_file.end(), in_file.begin(), in_file.end());
+    if (planes.stride && in_file.size() / planes.stride < plane_params::min_plane_size) {
+      printf("input too small for stride %d, not split\n", int(planes.stride));
+      planes = plane_params();
+    }
+
+    // each plane is coded in blocks of its own, one after the other.
+    ctxt.planes = planes;
+    const uint8_t *src = in_file.begin();
+    std::vector<uint8_t> plane_buffer;
+    if (planes.stride) {
+      plane_buffer.resize(in_file.size());
+      plane_split(planes, plane_buffer.data(), in_file.begin(), in_file.size());
+      src = plane_buffer.data();
+    }
+
+    if (target_mbps) {
+      uint32_t methods = planes.stride ? ~(1u << coding_level::order1) : ~0u;
+      level = level_tune(target_mbps, src, src + in_file.size(), methods);
+      printf("level %d\n", level);
+    }
+    const coding_level &l = coding_level::get(level ? level : coding_level::default_level);
+    ctxt.method = l.method;
+
+    map out_file(outname, "w", sizeof(ctxt) + l.bound(in_file.size()) + planes.stride * (range_block::header_size + 4));
+    auto end = out_file.begin() + sizeof(ctxt);
+    for (size_t size : planes.plane_sizes(in_file.size())) {
+      end = parallel && l.method == coding_level::order0 ?
+        parallel_range_encoder(ctxt, topology, threads, end, out_file.end(), src, src + size, l.block_size) :
+        level_encoder(ctxt, l, end, out_file.end(), src, src + size)
+      ;
+      if (end == out_file.end()) break;
+      src += size;
+    }
+    ctxt.size = in_file.size();
     if (end == out_file.end()) {
       printf("error: compressed file too long\n");
       out_file.truncate(0);
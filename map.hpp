@@ -10,6 +10,10 @@
 #ifndef _MAP_HPP_INCLUDED_
 #define _MAP_HPP_INCLUDED_
 
+#include <string>
+#include <cstdint>
+#include <stdio.h>
+
 
 #ifdef _MSC_VER
   #include <windows.h>
@@ -45,6 +49,7 @@ private:
       switch (*mode++) {
         case 'r': read_ = true; break;
         case 'w': write_ = true; break;
+        case 'l': lazy_ = true; break;
         default: return;
       }
     }
@@ -83,7 +88,7 @@ private:
         if (fd_ != -1) {
           size_ = size_t(lseek(fd_, 0l, SEEK_END));
           lseek(fd_, 0l, SEEK_SET);
-          data_  = mmap(NULL, size_, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd_, 0);
+          data_  = mmap(NULL, size_, PROT_READ, MAP_PRIVATE | (lazy_ ? 0 : MAP_POPULATE), fd_, 0);
         }
       } else if (write_) {
         printf("writing %s %ld\n", filename, long(size));
@@ -167,9 +172,10 @@ private:
     int fd_ = -1;
   #endif
   void *data_ = nullptr;
-  size_t size_;
+  size_t size_ = 0;
   bool read_ = false;
   bool write_ = false;
+  bool lazy_ = false;
 };
 
 #endif
@@ -0,0 +1,359 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Trained models shared between encoder and decoder.
+//
+// range_encoder builds a histogram of its input and ships the table with
+// the data, which is expensive for short messages. A model is trained once
+// from a sample corpus (see rctrain.cpp) and referenced by id instead.
+//
+// Order 0 models have a single table, order 1 models have a table for
+// each value of the previous byte. Every symbol has a non-zero frequency
+// so any input can be coded with any model.
+//
+// A model sent with the data it was trained on (see levels.hpp) is finished
+// without smoothing, so that only the symbols seen have a range, and is
+// written in the compact form: only the contexts seen, each table in the
+// form written by range_write_table.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef _MODEL_HPP_INCLUDED_
+#define _MODEL_HPP_INCLUDED_
+
+#include <cstdint>
+#include <stdio.h>
+#include <string.h>
+#include <array>
+#include <vector>
+#include <algorithm>
+
+#include "range_encoder.hpp"
+#include "range_decoder.hpp"
+#include "checksum.hpp"
+#include "map.hpp"
+
+class model {
+public:
+  static const uint32_t num_symbols = 256;
+
+  // symbol lookup in the decoder is by value >> lookup_shift.
+  static const int lookup_shift = 4;
+
+  struct header {
+    char sig[8] = "rcmodel";
+    uint32_t id = 0;
+    uint32_t order = 0;
+  };
+
+  model(uint32_t id=0, uint32_t order=0) {
+    header_.id = id;
+    header_.order = order;
+    counts_.assign(num_contexts() * num_symbols, 0);
+  }
+
+  uint32_t id() const { return header_.id; }
+  uint32_t order() const { return header_.order; }
+  uint32_t num_contexts() const { return header_.order ? num_symbols : 1; }
+
+  // the context to use for the symbol following prev.
+  uint32_t context(uint8_t prev) const { return header_.order ? prev : 0; }
+
+  // add a sample to the frequency counts. Call finish() when done.
+  void train(const uint8_t *begin, const uint8_t *end) {
+    uint8_t prev = 0;
+    for (auto p = begin; p != end; ++p) {
+      counts_[context(prev) * num_symbols + *p]++;
+      prev = *p;
+    }
+  }
+
+  // convert the counts to tables. Without smoothing, symbols that were
+  // not seen can not be coded and contexts that were not seen are uniform.
+  void finish(bool smooth = true) {
+    starts_.resize(num_contexts());
+    seen_.assign(num_contexts(), true);
+    for (uint32_t ctx = 0; ctx != num_contexts(); ++ctx) {
+      std::array<size_t, num_symbols> sizes;
+      size_t total = 0;
+      for (uint32_t sym = 0; sym != num_symbols; ++sym) {
+        sizes[sym] = counts_[ctx * num_symbols + sym] + (smooth ? 1 : 0);
+        total += sizes[sym];
+      }
+      if (total == 0) {
+        sizes.fill(1);
+        total = num_symbols;
+        seen_[ctx] = false;
+      }
+      normalize_frequencies(sizes, total);
+      for (uint32_t sym = 0, start = 0; sym != num_symbols; ++sym) {
+        starts_[ctx][sym] = start;
+        start += uint32_t(sizes[sym]);
+      }
+      starts_[ctx][num_symbols] = range_encoder_state::total;
+    }
+    build_lookup();
+  }
+
+  const uint32_t *starts(uint32_t ctx) const { return starts_[ctx].data(); }
+
+  // find the symbol whose range contains value.
+  uint8_t symbol(uint32_t ctx, uint32_t value) const {
+    uint32_t sym = lookup_[ctx][value >> lookup_shift];
+    const uint32_t *starts = starts_[ctx].data();
+    while (starts[sym+1] <= value) ++sym;
+    return uint8_t(sym);
+  }
+
+  // the file is the header followed by size-1 of each symbol as 16 bits.
+  size_t bytes() const { return sizeof(header) + num_contexts() * num_symbols * 2; }
+
+  template <class OutIter>
+  OutIter write(OutIter dest) const {
+    const uint8_t *h = (const uint8_t *)&header_;
+    dest = std::copy(h, h + sizeof(header), dest);
+    for (uint32_t ctx = 0; ctx != num_contexts(); ++ctx) {
+      for (uint32_t sym = 0; sym != num_symbols; ++sym) {
+        uint32_t size = starts_[ctx][sym+1] - starts_[ctx][sym] - 1;
+        *dest++ = uint8_t(size);
+        *dest++ = uint8_t(size >> 8);
+      }
+    }
+    return dest;
+  }
+
+  template <class InIter>
+  bool read(InIter &p, InIter end) {
+    if (size_t(end - p) < sizeof(header) || !std::equal(header_.sig, header_.sig + sizeof(header_.sig), p)) return false;
+    std::copy(p, p + sizeof(header), (uint8_t *)&header_);
+    p += sizeof(header);
+    if (header_.order > 1 || size_t(end - p) < bytes() - sizeof(header)) return false;
+
+    starts_.resize(num_contexts());
+    seen_.assign(num_contexts(), true);
+    for (uint32_t ctx = 0; ctx != num_contexts(); ++ctx) {
+      uint32_t start = 0;
+      for (uint32_t sym = 0; sym != num_symbols; ++sym) {
+        starts_[ctx][sym] = start;
+        start += ((p[0] & 0xff) | (p[1] & 0xff) << 8) + 1;
+        p += 2;
+      }
+      if (start != range_encoder_state::total) return false;
+      starts_[ctx][num_symbols] = start;
+    }
+    counts_.clear();
+    build_lookup();
+    return true;
+  }
+
+  // the compact form is the header, a bitmap of the contexts seen and a
+  // bitmap and size-1 of each symbol with a range for each context seen.
+  static const size_t max_compact_bytes = sizeof(header) + 32 + num_symbols * (32 + num_symbols * 2);
+
+  size_t compact_bytes() const {
+    size_t result = sizeof(header) + 32;
+    for (uint32_t ctx = 0; ctx != num_contexts(); ++ctx) {
+      if (!seen_[ctx]) continue;
+      result += 32;
+      for (uint32_t sym = 0; sym != num_symbols; ++sym) {
+        if (starts_[ctx][sym+1] != starts_[ctx][sym]) result += 2;
+      }
+    }
+    return result;
+  }
+
+  template <class OutIter>
+  OutIter write_compact(OutIter dest) const {
+    const uint8_t *h = (const uint8_t *)&header_;
+    dest = std::copy(h, h + sizeof(header), dest);
+    dest = write_bitmap(dest, [&](uint32_t ctx) { return ctx < num_contexts() && seen_[ctx]; });
+    for (uint32_t ctx = 0; ctx != num_contexts(); ++ctx) {
+      if (!seen_[ctx]) continue;
+      const uint32_t *starts = starts_[ctx].data();
+      dest = write_bitmap(dest, [&](uint32_t sym) { return starts[sym+1] != starts[sym]; });
+      for (uint32_t sym = 0; sym != num_symbols; ++sym) {
+        uint32_t size = starts[sym+1] - starts[sym];
+        if (size) {
+          *dest++ = uint8_t(size - 1);
+          *dest++ = uint8_t((size - 1) >> 8);
+        }
+      }
+    }
+    return dest;
+  }
+
+  template <class InIter>
+  bool read_compact(InIter &p, InIter end) {
+    if (size_t(end - p) < sizeof(header) + 32 || !std::equal(header_.sig, header_.sig + sizeof(header_.sig), p)) return false;
+    std::copy(p, p + sizeof(header), (uint8_t *)&header_);
+    p += sizeof(header);
+    if (header_.order > 1) return false;
+    auto contexts = p;
+    p += 32;
+
+    starts_.resize(num_contexts());
+    seen_.assign(num_contexts(), false);
+    for (uint32_t ctx = 0; ctx != num_symbols; ++ctx) {
+      bool seen = (contexts[ctx >> 3] >> (ctx & 7)) & 1;
+      if (ctx >= num_contexts()) {
+        if (seen) return false;
+        continue;
+      }
+      seen_[ctx] = seen;
+      if (!seen) {
+        for (uint32_t sym = 0; sym != num_symbols + 1; ++sym) starts_[ctx][sym] = sym * (range_encoder_state::total / num_symbols);
+        continue;
+      }
+
+      if (size_t(end - p) < 32) return false;
+      auto present = p;
+      p += 32;
+      uint32_t start = 0;
+      for (uint32_t sym = 0; sym != num_symbols; ++sym) {
+        starts_[ctx][sym] = start;
+        if ((present[sym >> 3] >> (sym & 7)) & 1) {
+          if (size_t(end - p) < 2) return false;
+          start += ((p[0] & 0xff) | (p[1] & 0xff) << 8) + 1;
+          p += 2;
+        }
+      }
+      if (start != range_encoder_state::total) return false;
+      starts_[ctx][num_symbols] = start;
+    }
+    counts_.clear();
+    build_lookup();
+    return true;
+  }
+
+  bool save(const char *filename) const {
+    map file(filename, "w", bytes());
+    if (file.size() != bytes() || !file.data()) return false;
+    write(file.begin());
+    return true;
+  }
+
+  bool load(const char *filename) {
+    map file(filename, "r");
+    const uint8_t *p = file.begin();
+    return read(p, (const uint8_t *)file.end()) && p == file.end();
+  }
+
+private:
+  template <class OutIter, class Pred>
+  static OutIter write_bitmap(OutIter dest, Pred pred) {
+    for (uint32_t i = 0; i != num_symbols; i += 8) {
+      uint8_t bits = 0;
+      for (uint32_t j = 0; j != 8; ++j) bits |= uint8_t(pred(i + j)) << j;
+      *dest++ = bits;
+    }
+    return dest;
+  }
+
+  void build_lookup() {
+    lookup_.resize(num_contexts());
+    for (uint32_t ctx = 0; ctx != num_contexts(); ++ctx) {
+      const uint32_t *starts = starts_[ctx].data();
+      for (uint32_t i = 0, sym = 0; i != lookup_size; ++i) {
+        while (starts[sym+1] <= (i << lookup_shift)) ++sym;
+        lookup_[ctx][i] = uint8_t(sym);
+      }
+    }
+  }
+
+  static const uint32_t lookup_size = range_encoder_state::total >> lookup_shift;
+
+  header header_;
+  std::vector<uint64_t> counts_;
+  std::vector<bool> seen_;
+  std::vector<std::array<uint32_t, num_symbols+1>> starts_;
+  std::vector<std::array<uint8_t, lookup_size>> lookup_;
+};
+
+// messages start with the model id and the size as varints, see range_block.hpp,
+// followed by a 4 byte crc32c of the message.
+// the model id and decoded size of a message so that the caller can pick a model and allocate space.
+template <class InIter>
+bool model_message_header(InIter begin, InIter end, uint32_t &id, size_t &size) {
+  uint64_t id64, size64;
+  if (!get_varint(begin, end, id64) || !get_varint(begin, end, size64)) return false;
+  id = uint32_t(id64);
+  size = size_t(size64);
+  return true;
+}
+
+// largest possible message for size bytes. A symbol can cost up to 16 bits.
+inline size_t model_message_bound(size_t size) {
+  // id and size varints, crc and the final flush.
+  return size * 2 + 32;
+}
+
+// code a message using a trained model. No tables are sent.
+template <class Context, class InIter, class OutIter>
+OutIter
+model_encoder(Context &ctxt, const model &m, OutIter dest, OutIter destmax, InIter begin, InIter end) {
+  ctxt.size = size_t(end - begin);
+  crc32c_stream crc;
+  for (auto p = begin; p != end; ++p) crc.put(uint8_t(*p));
+  if (!put_varint(dest, destmax, m.id()) || !put_varint(dest, destmax, ctxt.size) || destmax - dest < 4) return destmax;
+  range_block::put32(dest, crc.value());
+
+  range_encoder_state state;
+  auto emit = [&](uint8_t byte) { *dest++ = byte; return dest < destmax; };
+  uint8_t prev = 0;
+  for (auto p = begin; p != end; ++p) {
+    uint8_t sym = *p;
+    const uint32_t *starts = m.starts(m.context(prev));
+    if (!state.put(starts[sym], starts[sym+1] - starts[sym], emit)) return destmax;
+    prev = sym;
+  }
+
+  if (!state.flush_short(emit)) return destmax;
+  return dest;
+}
+
+// decode a message coded with model_encoder. ctxt.size is set to the decoded size.
+template <class Context, class InIter, class OutIter>
+OutIter
+model_decoder(Context &ctxt, const model &m, OutIter dest, OutIter destmax, InIter begin, InIter end) {
+  auto p = begin;
+  uint64_t id, size;
+  if (!get_varint(p, end, id) || !get_varint(p, end, size) || end - p < 4) {
+    ctxt.error(0, "bad message header");
+    return dest;
+  }
+  uint32_t expected_crc = range_block::get32(p);
+  if (id != m.id()) {
+    ctxt.error(0, "wrong model");
+    return dest;
+  }
+  ctxt.size = size_t(size);
+
+  // flush_short leaves out trailing zeros, less than a code value's worth.
+  size_t padding = 0;
+  auto next = [&]() { return p != end ? int(*p++ & 0xff) : padding++ < sizeof(uint64_t) ? 0 : -1; };
+  range_decoder_state state;
+  state.init(next);
+
+  size_t max_size = std::min(ctxt.size, size_t(destmax - dest));
+  auto start = dest;
+  crc32c_stream crc;
+  uint8_t prev = 0;
+  for (size_t i = 0; i != max_size; ++i) {
+    uint32_t ctx = m.context(prev);
+    auto value = state.value();
+    if (value >= range_decoder_state::total) { ctxt.error(i, "corrupt input"); return dest; }
+    uint8_t sym = m.symbol(ctx, uint32_t(value));
+    const uint32_t *starts = m.starts(ctx);
+    if (!state.update(starts[sym], starts[sym+1] - starts[sym], next)) { ctxt.error(i, "corrupt input"); return dest; }
+    *dest++ = sym;
+    crc.put(sym);
+    prev = sym;
+  }
+
+  if (max_size == ctxt.size && crc.value() != expected_crc) {
+    ctxt.error(0, "checksum mismatch");
+    return start;
+  }
+  return dest;
+}
+
+#endif
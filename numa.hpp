@@ -0,0 +1,131 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// NUMA topology.
+//
+// Lists the cpus belonging to each memory node so that worker threads can
+// be kept on the node that holds their data. On machines without NUMA
+// information this is a single node with every cpu.
+//
+// numa_topology::fake splits the cpus into several nodes so that the
+// NUMA code paths can be tested on a single node machine.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef _NUMA_HPP_INCLUDED_
+#define _NUMA_HPP_INCLUDED_
+
+#include <cstdint>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <thread>
+
+#ifdef __linux__
+  #include <pthread.h>
+  #include <sched.h>
+#endif
+
+class numa_topology {
+public:
+  numa_topology() {}
+
+  size_t num_nodes() const { return nodes_.size(); }
+  const std::vector<int> &cpus(size_t node) const { return nodes_[node]; }
+
+  size_t num_cpus() const {
+    size_t result = 0;
+    for (auto &node : nodes_) result += node.size();
+    return result;
+  }
+
+  // the topology of this machine.
+  static numa_topology detect() {
+    numa_topology result;
+    #ifdef __linux__
+      for (int node = 0; ; ++node) {
+        std::string name = "/sys/devices/system/node/node" + std::to_string(node) + "/cpulist";
+        FILE *file = fopen(name.c_str(), "r");
+        if (!file) break;
+        char buf[4096];
+        size_t size = fread(buf, 1, sizeof(buf)-1, file);
+        fclose(file);
+        buf[size] = 0;
+        std::vector<int> cpus = parse_cpulist(buf);
+        if (!cpus.empty()) result.nodes_.push_back(cpus);
+      }
+    #endif
+    if (result.nodes_.empty()) {
+      std::vector<int> cpus;
+      for (int cpu = 0; cpu != int(std::max(1u, std::thread::hardware_concurrency())); ++cpu) {
+        cpus.push_back(cpu);
+      }
+      result.nodes_.push_back(cpus);
+    }
+    return result;
+  }
+
+  // pretend that this machine has num_nodes nodes by dealing out its cpus.
+  static numa_topology fake(size_t num_nodes) {
+    numa_topology real = detect();
+    std::vector<int> all;
+    for (auto &node : real.nodes_) all.insert(all.end(), node.begin(), node.end());
+
+    numa_topology result;
+    result.nodes_.resize(std::max(size_t(1), num_nodes));
+    for (size_t i = 0; i != std::max(all.size(), result.nodes_.size()); ++i) {
+      result.nodes_[i % result.nodes_.size()].push_back(all[i % all.size()]);
+    }
+    return result;
+  }
+
+  // run the calling thread on the cpus of node.
+  void bind(size_t node) const {
+    #ifdef __linux__
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      for (int cpu : nodes_[node]) {
+        if (cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+      }
+      pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    #endif
+  }
+
+  // the node of each of num_threads workers, shared out by the number of cpus on each node.
+  std::vector<size_t> workers(size_t num_threads) const {
+    num_threads = std::max(num_threads, num_nodes());
+    std::vector<size_t> result;
+    size_t total_cpus = num_cpus();
+    for (size_t node = 0, cpus = 0; node != num_nodes(); ++node) {
+      size_t first = cpus * num_threads / total_cpus;
+      cpus += nodes_[node].size();
+      size_t last = cpus * num_threads / total_cpus;
+      result.insert(result.end(), std::max(last - first, size_t(1)), node);
+    }
+    return result;
+  }
+
+private:
+  // eg. "0-3,8-11"
+  static std::vector<int> parse_cpulist(const char *p) {
+    std::vector<int> result;
+    while (*p >= '0' && *p <= '9') {
+      char *e;
+      int first = (int)strtol(p, &e, 10);
+      int last = first;
+      p = e;
+      if (*p == '-') {
+        last = (int)strtol(p + 1, &e, 10);
+        p = e;
+      }
+      for (int cpu = first; cpu <= last; ++cpu) result.push_back(cpu);
+      if (*p == ',') ++p;
+    }
+    return result;
+  }
+
+  std::vector<std::vector<int>> nodes_;
+};
+
+#endif
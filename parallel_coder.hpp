@@ -0,0 +1,258 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Block parallel range coding with NUMA aware worker placement.
+//
+// The blocks of range_encoder are independent so they can be coded by a
+// pool of workers. Each memory node gets its own workers and a contiguous
+// range of blocks. A worker takes blocks from the front of its own node's
+// range and only steals from the back of another node's range when its
+// own is empty.
+//
+// Input pages are faulted in by the worker that reads them and output is
+// first written by the worker that coded it, so both end up on the node
+// that uses them.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef _PARALLEL_CODER_HPP_INCLUDED_
+#define _PARALLEL_CODER_HPP_INCLUDED_
+
+#include <cstdint>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+
+#include "numa.hpp"
+#include "range_encoder.hpp"
+#include "range_decoder.hpp"
+
+// hands out block numbers to workers, preferring blocks on their own node.
+class numa_scheduler {
+public:
+  numa_scheduler(size_t num_nodes) : num_nodes_(num_nodes), ranges_(new range_t[num_nodes]) {}
+
+  // split blocks [first, last) between the nodes in proportion to their workers.
+  void reset(size_t first, size_t last, const std::vector<size_t> &worker_nodes) {
+    std::vector<size_t> weights(num_nodes_);
+    for (size_t node : worker_nodes) weights[node]++;
+    size_t total = worker_nodes.size();
+    for (size_t node = 0, acc = 0; node != num_nodes_; ++node) {
+      size_t begin = first + (last - first) * acc / total;
+      acc += weights[node];
+      size_t end = first + (last - first) * acc / total;
+      ranges_[node].value.store(make(begin, end));
+    }
+  }
+
+  // the next block for a worker on node. false when there are no blocks left.
+  bool next(size_t node, size_t &block) {
+    if (take_front(node, block)) return true;
+    for (size_t i = 1; i != num_nodes_; ++i) {
+      if (take_back((node + i) % num_nodes_, block)) return true;
+    }
+    return false;
+  }
+
+private:
+  static uint64_t make(uint64_t begin, uint64_t end) { return begin << 32 | end; }
+
+  bool take_front(size_t node, size_t &block) {
+    auto &range = ranges_[node].value;
+    uint64_t value = range.load();
+    while (uint32_t(value >> 32) < uint32_t(value)) {
+      if (range.compare_exchange_weak(value, value + ((uint64_t)1 << 32))) {
+        block = size_t(value >> 32);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool take_back(size_t node, size_t &block) {
+    auto &range = ranges_[node].value;
+    uint64_t value = range.load();
+    while (uint32_t(value >> 32) < uint32_t(value)) {
+      if (range.compare_exchange_weak(value, value - 1)) {
+        block = size_t(uint32_t(value) - 1);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // one cache line per node.
+  struct alignas(64) range_t {
+    std::atomic<uint64_t> value{0};
+  };
+
+  size_t num_nodes_;
+  std::unique_ptr<range_t[]> ranges_;
+};
+
+// wait for all workers to reach the same point.
+class worker_barrier {
+public:
+  worker_barrier(size_t count) : count_(count) {}
+
+  void wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    size_t generation = generation_;
+    if (++waiting_ == count_) {
+      waiting_ = 0;
+      generation_++;
+      cv_.notify_all();
+    } else {
+      cv_.wait(lock, [&] { return generation != generation_; });
+    }
+  }
+
+private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  size_t count_;
+  size_t waiting_ = 0;
+  size_t generation_ = 0;
+};
+
+// run fn(worker, node) on a thread for each worker, bound to its node.
+template <class Fn>
+void numa_run(const numa_topology &topology, const std::vector<size_t> &worker_nodes, Fn fn) {
+  std::vector<std::thread> threads;
+  for (size_t worker = 0; worker != worker_nodes.size(); ++worker) {
+    threads.emplace_back([&, worker]() {
+      topology.bind(worker_nodes[worker]);
+      fn(worker, worker_nodes[worker]);
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+// the same stream as range_encoder, coded by num_threads workers.
+// The input is coded a window of blocks at a time to bound the memory used.
+template <class Context>
+uint8_t *
+parallel_range_encoder(Context &ctxt, const numa_topology &topology, size_t num_threads, uint8_t *dest, uint8_t *destmax, const uint8_t *begin, const uint8_t *end, size_t block_size = range_block::default_size) {
+  ctxt.size = size_t(end - begin);
+  size_t num_blocks = (ctxt.size + block_size - 1) / block_size;
+
+  std::vector<size_t> worker_nodes = topology.workers(num_threads);
+  size_t num_workers = worker_nodes.size();
+  size_t window = num_workers * 64;
+
+  numa_scheduler scheduler(topology.num_nodes());
+  worker_barrier barrier(num_workers);
+
+  // where each block of the window was coded.
+  struct coded_block {
+    size_t worker;
+    size_t offset;
+    size_t size;
+  };
+  std::vector<coded_block> blocks(std::min(window, num_blocks));
+  std::vector<std::vector<uint8_t>> buffers(num_workers);
+  std::atomic<bool> failed{false};
+
+  numa_run(topology, worker_nodes, [&](size_t worker, size_t node) {
+    auto &buffer = buffers[worker];
+    for (size_t first = 0; first < num_blocks; first += window) {
+      size_t last = std::min(num_blocks, first + window);
+      if (worker == 0) scheduler.reset(first, last, worker_nodes);
+      barrier.wait();
+
+      // code blocks into this worker's buffer, which is first touched here.
+      size_t used = 0;
+      size_t block;
+      while (scheduler.next(node, block)) {
+        auto block_begin = begin + block * block_size;
+        auto block_end = block_begin + std::min(size_t(end - block_begin), block_size);
+        size_t bound = range_block::bound(size_t(block_end - block_begin), block_size);
+        if (buffer.size() < used + bound) buffer.resize(used + bound);
+        uint8_t *out = buffer.data() + used;
+        // the next block belongs to another worker so is not prefetched.
+        uint8_t *out_end = range_encode_block(out, out + bound, block_begin, block_end, block_end);
+        blocks[block - first] = coded_block{worker, used, size_t(out_end - out)};
+        used += out_end - out;
+      }
+      barrier.wait();
+
+      // each worker writes its own blocks to the output.
+      size_t offset = 0;
+      for (size_t i = 0; i != last - first; ++i) {
+        auto &b = blocks[i];
+        if (b.worker == worker && !failed) {
+          if (size_t(destmax - dest) <= offset + b.size) {
+            failed = true;
+          } else {
+            std::copy(buffer.data() + b.offset, buffer.data() + b.offset + b.size, dest + offset);
+          }
+        }
+        offset += b.size;
+      }
+      barrier.wait();
+
+      if (worker == 0) dest += offset;
+      barrier.wait();
+      if (failed) break;
+    }
+  });
+
+  return failed ? destmax : dest;
+}
+
+// decode a stream written by range_encoder or parallel_range_encoder with num_threads workers.
+template <class Context>
+uint8_t *
+parallel_range_decoder(Context &ctxt, const numa_topology &topology, size_t num_threads, uint8_t *dest, uint8_t *destmax, const uint8_t *begin, const uint8_t *end) {
+  size_t max_size = std::min(ctxt.size, size_t(destmax - dest));
+
+  // find the blocks from their headers.
+  struct block_pos {
+    const uint8_t *src;
+    size_t offset;
+  };
+  std::vector<block_pos> blocks;
+  size_t offset = 0;
+  for (auto p = begin; offset < max_size; ) {
+    range_block block;
+    auto src = p;
+    if (!block.read(p, end) || block.raw_size == 0) {
+      ctxt.error(offset, "bad block header");
+      break;
+    }
+    blocks.push_back(block_pos{src, offset});
+    offset += block.raw_size;
+    p += block.coded_size;
+  }
+
+  std::vector<size_t> worker_nodes = topology.workers(num_threads);
+  numa_scheduler scheduler(topology.num_nodes());
+  scheduler.reset(0, blocks.size(), worker_nodes);
+
+  // the offset of the first block that failed.
+  std::atomic<size_t> error_offset{offset < max_size ? offset : max_size};
+
+  numa_run(topology, worker_nodes, [&](size_t, size_t node) {
+    range_block_decoder decoder;
+    size_t block;
+    while (scheduler.next(node, block)) {
+      auto &b = blocks[block];
+      if (b.offset >= error_offset) continue;
+      uint8_t *out = dest + b.offset;
+      auto p = b.src;
+      if (!decoder.decode(ctxt, b.offset, out, dest + max_size, p, end)) {
+        size_t current = error_offset;
+        while (b.offset < current && !error_offset.compare_exchange_weak(current, b.offset)) {
+        }
+      }
+    }
+  });
+
+  return dest + error_offset;
+}
+
+#endif
@@ -0,0 +1,273 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Patches: a file coded as differences from a reference file.
+//
+// The reference is indexed by a hash of every window_size bytes at every
+// step bytes. The index holds one 32 bit slot per window, a quarter of the
+// size of the reference. The new file is scanned with a rolling hash and each window
+// found in the reference is extended in both directions into a copy. The
+// bytes between copies are literals.
+//
+// Each command is three varints, see range_block.hpp:
+//
+//   literal length   bytes taken from the literal stream
+//   copy length      bytes copied from the reference
+//   copy offset      start of the copy less the end of the previous copy,
+//                    zig-zag coded
+//
+// The commands and the literals are range coded separately. The file is:
+//
+//   signature       8 bytes "rcpatch"
+//   size            8 bytes size of the new file
+//   reference size  8 bytes
+//   reference crc   4 bytes crc32c of the reference
+//   crc             4 bytes crc32c of the new file
+//   command size    8 bytes size of the commands before coding
+//   literal size    8 bytes size of the literals before coding
+//   coded commands  8 bytes size of the coded commands
+//   commands
+//   literals
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef _PATCH_HPP_INCLUDED_
+#define _PATCH_HPP_INCLUDED_
+
+#include <cstdint>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+
+#include "checksum.hpp"
+#include "range_block.hpp"
+#include "range_encoder.hpp"
+#include "range_decoder.hpp"
+
+class patch {
+public:
+  static const size_t window_size = 32;
+  static const size_t header_size = 64;
+
+  // index the reference, which must stay valid while the patch is made.
+  patch(const uint8_t *ref_begin, const uint8_t *ref_end) : ref_(ref_begin), ref_size_(size_t(ref_end - ref_begin)) {
+    // at most 2^26 index entries, one every 16 bytes for references up to 1GB.
+    // Slots hold positions divided by the step.
+    step_ = std::max(size_t(16), ref_size_ >> 26);
+    table_.assign(ref_size_ / step_ + 1, uint32_t(empty));
+
+    power_ = 1;
+    for (size_t i = 1; i != window_size; ++i) power_ *= multiplier;
+
+    if (ref_size_ < window_size) return;
+    uint64_t h = hash(ref_);
+    for (size_t pos = 0; ; ) {
+      if (pos % step_ == 0) table_[bucket(h)] = uint32_t(pos / step_);
+      if (pos + window_size == ref_size_) break;
+      h = roll(h, ref_[pos], ref_[pos + window_size]);
+      ++pos;
+    }
+  }
+
+  // largest possible patch for size bytes.
+  static size_t bound(size_t size) {
+    return header_size + range_block::bound(size) * 2 + 64;
+  }
+
+  // code [begin, end) as a patch against the reference.
+  // returns destmax if there is not enough room.
+  template <class Context>
+  uint8_t *encode(Context &ctxt, uint8_t *dest, uint8_t *destmax, const uint8_t *begin, const uint8_t *end) const {
+    size_t size = size_t(end - begin);
+    std::vector<uint8_t> commands;
+    std::vector<uint8_t> literals;
+
+    const uint8_t *literal = begin;
+    size_t prev_end = 0;
+    auto command = [&](const uint8_t *copy, size_t copy_length, size_t copy_offset) {
+      literals.insert(literals.end(), literal, copy);
+      put(commands, size_t(copy - literal));
+      put(commands, copy_length);
+      int64_t delta = int64_t(copy_offset - prev_end);
+      put(commands, uint64_t(delta) << 1 ^ uint64_t(delta >> 63));
+      prev_end = copy_offset + copy_length;
+      literal = copy + copy_length;
+    };
+
+    const uint8_t *p = begin;
+    if (size >= window_size && ref_size_ >= window_size) {
+      uint64_t h = hash(p);
+      for (;;) {
+        uint32_t slot = table_[bucket(h)];
+        size_t candidate = size_t(slot) * step_;
+        if (slot != empty && !memcmp(ref_ + candidate, p, window_size)) {
+          // extend the match back into the literals and forward as far as it goes.
+          size_t back = 0;
+          while (back < size_t(p - literal) && back < candidate && p[-1 - (ptrdiff_t)back] == ref_[candidate - 1 - back]) ++back;
+          size_t length = window_size + match_length(p + window_size, end, ref_ + candidate + window_size, ref_ + ref_size_);
+          command(p - back, back + length, candidate - back);
+          p = literal;
+          if (size_t(end - p) < window_size) break;
+          h = hash(p);
+        } else {
+          if (p + window_size == end) break;
+          h = roll(h, p[0], p[window_size]);
+          ++p;
+        }
+      }
+    }
+    command(end, 0, prev_end);
+
+    // header, coded commands then coded literals.
+    if (size_t(destmax - dest) < header_size) return destmax;
+    uint8_t *header = dest;
+    dest += header_size;
+    uint8_t *literals_begin = range_encoder(ctxt, dest, destmax, commands.data(), commands.data() + commands.size());
+    if (literals_begin == destmax) return destmax;
+    dest = range_encoder(ctxt, literals_begin, destmax, literals.data(), literals.data() + literals.size());
+    if (dest == destmax) return destmax;
+
+    memcpy(header, signature(), 8);
+    put64(header + 8, size);
+    put64(header + 16, ref_size_);
+    put32(header + 24, crc32c(ref_, ref_size_));
+    put32(header + 28, crc32c(begin, size));
+    put64(header + 32, commands.size());
+    put64(header + 40, literals.size());
+    put64(header + 48, uint64_t(literals_begin - (header + header_size)));
+    ctxt.size = size;
+    return dest;
+  }
+
+  // true if [begin, end) is a patch. size is the size of the file it makes.
+  static bool header(const uint8_t *begin, const uint8_t *end, size_t &size) {
+    if (size_t(end - begin) < header_size || memcmp(begin, signature(), 8)) return false;
+    size = size_t(get64(begin + 8));
+    return true;
+  }
+
+  // apply the patch in [begin, end) to the reference, writing the new file to dest.
+  // returns dest + the size of the new file or dest on error.
+  template <class Context>
+  uint8_t *apply(Context &ctxt, uint8_t *dest, uint8_t *destmax, const uint8_t *begin, const uint8_t *end) const {
+    size_t size;
+    if (!header(begin, end, size)) {
+      ctxt.error(0, "not a patch");
+      return dest;
+    }
+    if (get64(begin + 16) != ref_size_ || get32(begin + 24) != crc32c(ref_, ref_size_)) {
+      ctxt.error(0, "wrong reference");
+      return dest;
+    }
+    uint32_t crc = get32(begin + 28);
+    uint64_t command_size = get64(begin + 32);
+    uint64_t literal_size = get64(begin + 40);
+    uint64_t coded_commands = get64(begin + 48);
+    const uint8_t *p = begin + header_size;
+    if (size > size_t(destmax - dest) || literal_size > size || coded_commands > size_t(end - p) || command_size > (size + 1) * 30) {
+      ctxt.error(0, "bad patch header");
+      return dest;
+    }
+
+    // each block of at most range_block::default_size bytes has a header.
+    if (
+      command_size > coded_commands / range_block::header_size * range_block::default_size ||
+      literal_size > (size_t(end - p) - coded_commands) / range_block::header_size * range_block::default_size
+    ) {
+      ctxt.error(0, "bad patch header");
+      return dest;
+    }
+
+    std::vector<uint8_t> commands(command_size);
+    std::vector<uint8_t> literals(literal_size);
+    ctxt.size = commands.size();
+    if (range_decoder(ctxt, commands.data(), commands.data() + commands.size(), p, p + coded_commands) != commands.data() + commands.size()) return dest;
+    ctxt.size = literals.size();
+    if (range_decoder(ctxt, literals.data(), literals.data() + literals.size(), p + coded_commands, end) != literals.data() + literals.size()) return dest;
+    ctxt.size = size;
+
+    // run the commands.
+    const uint8_t *c = commands.data();
+    const uint8_t *c_end = c + commands.size();
+    const uint8_t *literal = literals.data();
+    uint8_t *out = dest;
+    uint8_t *out_end = dest + size;
+    uint64_t prev_end = 0;
+    while (c != c_end) {
+      uint64_t literal_length, copy_length, zigzag;
+      if (!get_varint(c, c_end, literal_length) || !get_varint(c, c_end, copy_length) || !get_varint(c, c_end, zigzag)) break;
+      uint64_t copy_offset = prev_end + uint64_t(int64_t(zigzag >> 1) ^ -int64_t(zigzag & 1));
+      if (
+        literal_length > size_t(literals.data() + literals.size() - literal) || literal_length > size_t(out_end - out) ||
+        copy_length > size_t(out_end - out) - literal_length || copy_offset > ref_size_ || copy_length > ref_size_ - copy_offset
+      ) {
+        ctxt.error(size_t(out - dest), "bad patch command");
+        return dest;
+      }
+      out = std::copy(literal, literal + literal_length, out);
+      literal += literal_length;
+      out = std::copy(ref_ + copy_offset, ref_ + copy_offset + copy_length, out);
+      prev_end = copy_offset + copy_length;
+    }
+
+    if (c != c_end || out != out_end || crc32c(dest, size) != crc) {
+      ctxt.error(size_t(out - dest), "patch does not match");
+      return dest;
+    }
+    return out_end;
+  }
+
+private:
+  static const char *signature() { return "rcpatch"; }
+  static const uint64_t multiplier = 0x100000001b3ull;
+  static const uint32_t empty = ~(uint32_t)0;
+
+  uint64_t hash(const uint8_t *p) const {
+    uint64_t h = 0;
+    for (size_t i = 0; i != window_size; ++i) h = h * multiplier + p[i];
+    return h;
+  }
+
+  // move the window on by one byte.
+  uint64_t roll(uint64_t h, uint8_t out, uint8_t in) const {
+    return (h - out * power_) * multiplier + in;
+  }
+
+  // the slot for a hash, the table size need not be a power of two.
+  size_t bucket(uint64_t h) const {
+    return size_t(((h * 0x9e3779b97f4a7c15ull) >> 32) * table_.size() >> 32);
+  }
+
+  // the number of equal bytes at a and b, eight at a time.
+  static size_t match_length(const uint8_t *a, const uint8_t *a_end, const uint8_t *b, const uint8_t *b_end) {
+    size_t max = std::min(size_t(a_end - a), size_t(b_end - b));
+    size_t n = 0;
+    for (; n + 8 <= max; n += 8) {
+      uint64_t x, y;
+      memcpy(&x, a + n, 8);
+      memcpy(&y, b + n, 8);
+      if (x != y) break;
+    }
+    while (n != max && a[n] == b[n]) ++n;
+    return n;
+  }
+
+  static void put(std::vector<uint8_t> &out, uint64_t value) {
+    uint8_t tmp[10];
+    uint8_t *p = tmp;
+    put_varint(p, tmp + sizeof(tmp), value);
+    out.insert(out.end(), tmp, p);
+  }
+
+  static void put32(uint8_t *p, uint32_t value) { range_block::put32(p, value); }
+  static void put64(uint8_t *p, uint64_t value) { put32(p, uint32_t(value)); put32(p + 4, uint32_t(value >> 32)); }
+  static uint32_t get32(const uint8_t *p) { return range_block::get32(p); }
+  static uint64_t get64(const uint8_t *p) { return get32(p) | (uint64_t)get32(p + 4) << 32; }
+
+  const uint8_t *ref_;
+  size_t ref_size_;
+  size_t step_;
+  uint64_t power_;
+  std::vector<uint32_t> table_;
+};
+
+#endif
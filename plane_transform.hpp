@@ -0,0 +1,209 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Byte plane transform for arrays of fixed size binary records.
+//
+// Order 0 coding of an array of int32 or float64 values mixes the noisy low
+// bytes with the nearly constant high bytes. The transform splits records
+// of stride bytes into stride planes, plane j holding byte j of every
+// record, so that each plane is coded in blocks of its own with its own
+// table.
+//
+// Before the split the fields of width bytes in each record can be replaced
+// by the difference (sub) or exclusive or (xor) with the same field of the
+// previous record. Fields are little endian.
+//
+// Bytes after the last whole record are copied unchanged after the planes.
+//
+// Both directions work on tiles of records that fit in the L1 cache and
+// the loops are written so that the compiler can vectorise them.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef _PLANE_TRANSFORM_HPP_INCLUDED_
+#define _PLANE_TRANSFORM_HPP_INCLUDED_
+
+#include <cstdint>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+
+struct plane_params {
+  enum : uint8_t { none, sub, xor_ };
+
+  static const uint32_t max_stride = 4096;
+
+  // planes shorter than this cost more in block headers and tables than they save.
+  static const size_t min_plane_size = 4096;
+
+  // bytes in a record, zero for no transform.
+  uint32_t stride = 0;
+  // bytes in a field, 1, 2, 4 or 8, dividing stride.
+  uint8_t width = 1;
+  uint8_t delta = none;
+
+  bool valid() const {
+    return stride == 0 || (
+      stride <= max_stride &&
+      (width == 1 || width == 2 || width == 4 || width == 8) &&
+      stride % width == 0 && delta <= xor_
+    );
+  }
+
+  // the sizes of the planes and the tail that follows them for size bytes of input.
+  std::vector<size_t> plane_sizes(size_t size) const {
+    std::vector<size_t> result;
+    if (stride == 0) {
+      result.push_back(size);
+    } else {
+      result.assign(stride, size / stride);
+      result.push_back(size % stride);
+    }
+    return result;
+  }
+};
+
+namespace plane_detail {
+  static const size_t tile_bytes = 0x4000;
+
+  // dest[j * records + r] = byte j of record r of the tile.
+  // A constant Stride lets the compiler turn the loops into shuffles.
+  template <size_t Stride>
+  void split_tile(uint8_t *dest, size_t records, const uint8_t *tile, size_t num, size_t stride) {
+    if (Stride) stride = Stride;
+    for (size_t j = 0; j != stride; ++j) {
+      uint8_t *plane = dest + j * records;
+      const uint8_t *src = tile + j;
+      for (size_t r = 0; r != num; ++r) {
+        plane[r] = src[r * stride];
+      }
+    }
+  }
+
+  template <size_t Stride>
+  void join_tile(uint8_t *tile, size_t num, size_t stride, const uint8_t *src, size_t records) {
+    if (Stride) stride = Stride;
+    for (size_t j = 0; j != stride; ++j) {
+      const uint8_t *plane = src + j * records;
+      uint8_t *dest = tile + j;
+      for (size_t r = 0; r != num; ++r) {
+        dest[r * stride] = plane[r];
+      }
+    }
+  }
+
+  inline void split_tile(uint8_t *dest, size_t records, const uint8_t *tile, size_t num, size_t stride) {
+    switch (stride) {
+      case 2: split_tile<2>(dest, records, tile, num, stride); break;
+      case 4: split_tile<4>(dest, records, tile, num, stride); break;
+      case 8: split_tile<8>(dest, records, tile, num, stride); break;
+      case 16: split_tile<16>(dest, records, tile, num, stride); break;
+      default: split_tile<0>(dest, records, tile, num, stride); break;
+    }
+  }
+
+  inline void join_tile(uint8_t *tile, size_t num, size_t stride, const uint8_t *src, size_t records) {
+    switch (stride) {
+      case 2: join_tile<2>(tile, num, stride, src, records); break;
+      case 4: join_tile<4>(tile, num, stride, src, records); break;
+      case 8: join_tile<8>(tile, num, stride, src, records); break;
+      case 16: join_tile<16>(tile, num, stride, src, records); break;
+      default: join_tile<0>(tile, num, stride, src, records); break;
+    }
+  }
+
+  // delta code fields of type T, fields per record, with prev the last record of the previous tile.
+  template <class T>
+  void forward(const plane_params &params, uint8_t *dest, const uint8_t *src, size_t size) {
+    size_t stride = params.stride;
+    size_t records = size / stride;
+    size_t fields = stride / sizeof(T);
+    size_t tile_records = std::max(size_t(1), tile_bytes / stride);
+
+    std::vector<T> cur(tile_records * fields + fields);
+    std::vector<T> out(tile_records * fields);
+    T *prev = cur.data();
+    T *values = prev + fields;
+
+    for (size_t r0 = 0; r0 < records; r0 += tile_records) {
+      size_t num = std::min(tile_records, records - r0);
+      size_t n = num * fields;
+      memcpy(values, src + r0 * stride, num * stride);
+      if (params.delta == plane_params::sub) {
+        for (size_t i = 0; i != n; ++i) out[i] = T(values[i] - values[i - fields]);
+      } else if (params.delta == plane_params::xor_) {
+        for (size_t i = 0; i != n; ++i) out[i] = T(values[i] ^ values[i - fields]);
+      } else {
+        std::copy(values, values + n, out.data());
+      }
+      std::copy(values + n - fields, values + n, prev);
+      split_tile(dest + r0, records, (const uint8_t *)out.data(), num, stride);
+    }
+  }
+
+  template <class T>
+  void inverse(const plane_params &params, uint8_t *dest, const uint8_t *src, size_t size) {
+    size_t stride = params.stride;
+    size_t records = size / stride;
+    size_t fields = stride / sizeof(T);
+    size_t tile_records = std::max(size_t(1), tile_bytes / stride);
+
+    std::vector<T> in(tile_records * fields);
+    std::vector<T> cur(tile_records * fields + fields);
+    T *prev = cur.data();
+    T *values = prev + fields;
+
+    for (size_t r0 = 0; r0 < records; r0 += tile_records) {
+      size_t num = std::min(tile_records, records - r0);
+      size_t n = num * fields;
+      join_tile((uint8_t *)in.data(), num, stride, src + r0, records);
+      // each record depends on the one before, the fields of a record are independent.
+      if (params.delta == plane_params::sub) {
+        for (size_t r = 0; r != n; r += fields) {
+          for (size_t f = 0; f != fields; ++f) values[r + f] = T(in[r + f] + values[r + f - fields]);
+        }
+      } else if (params.delta == plane_params::xor_) {
+        for (size_t r = 0; r != n; r += fields) {
+          for (size_t f = 0; f != fields; ++f) values[r + f] = T(in[r + f] ^ values[r + f - fields]);
+        }
+      } else {
+        std::copy(in.data(), in.data() + n, values);
+      }
+      memcpy(dest + r0 * stride, values, num * stride);
+      std::copy(values + n - fields, values + n, prev);
+    }
+  }
+}
+
+// split size bytes at src into planes at dest. The buffers must not overlap.
+inline void plane_split(const plane_params &params, uint8_t *dest, const uint8_t *src, size_t size) {
+  if (params.stride == 0) {
+    memcpy(dest, src, size);
+    return;
+  }
+  switch (params.width) {
+    case 1: plane_detail::forward<uint8_t>(params, dest, src, size); break;
+    case 2: plane_detail::forward<uint16_t>(params, dest, src, size); break;
+    case 4: plane_detail::forward<uint32_t>(params, dest, src, size); break;
+    case 8: plane_detail::forward<uint64_t>(params, dest, src, size); break;
+  }
+  size_t body = size - size % params.stride;
+  memcpy(dest + body, src + body, size - body);
+}
+
+// the inverse of plane_split.
+inline void plane_join(const plane_params &params, uint8_t *dest, const uint8_t *src, size_t size) {
+  if (params.stride == 0) {
+    memcpy(dest, src, size);
+    return;
+  }
+  switch (params.width) {
+    case 1: plane_detail::inverse<uint8_t>(params, dest, src, size); break;
+    case 2: plane_detail::inverse<uint16_t>(params, dest, src, size); break;
+    case 4: plane_detail::inverse<uint32_t>(params, dest, src, size); break;
+    case 8: plane_detail::inverse<uint64_t>(params, dest, src, size); break;
+  }
+  size_t body = size - size % params.stride;
+  memcpy(dest + body, src + body, size - body);
+}
+
+#endif
@@ -0,0 +1,104 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Block format shared by range_encoder and range_decoder.
+//
+// The input is coded in blocks small enough to stay in cache between the
+// histogram and the coding pass. Each block is independent:
+//
+//   mode        1 byte   range_block::coded, stored or run
+//   raw size    4 bytes  uncompressed size of the block
+//   coded size  4 bytes  size of the data following the header
+//   crc32c      4 bytes  checksum of the uncompressed data
+//   data
+//
+// coded blocks start with the frequency table: a 256 bit map of present
+// symbols then size-1 of each present symbol as 16 bits.
+//
+// run blocks are used when one symbol dominates. They start with that
+// symbol, a table for the other symbols (the literals) and a table for
+// the run lengths. The data is a run length of the dominant symbol as
+// 7 bit varint bytes followed by a literal, ending with a run length.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef _RANGE_BLOCK_HPP_INCLUDED_
+#define _RANGE_BLOCK_HPP_INCLUDED_
+
+#include <cstdint>
+#include <cstddef>
+
+struct range_block {
+  enum : uint8_t { coded, stored, run };
+
+  static const size_t default_size = 0x20000;
+  static const size_t header_size = 13;
+
+  uint8_t mode = coded;
+  uint32_t raw_size = 0;
+  uint32_t coded_size = 0;
+  uint32_t crc = 0;
+
+  // largest possible output for size bytes of input.
+  static size_t bound(size_t size, size_t block_size = default_size) {
+    return size + (size / block_size + 1) * header_size + 1;
+  }
+
+  template <class OutIter>
+  void write(OutIter dest) const {
+    *dest++ = mode;
+    put32(dest, raw_size);
+    put32(dest, coded_size);
+    put32(dest, crc);
+  }
+
+  template <class InIter>
+  bool read(InIter &p, InIter end) {
+    if (size_t(end - p) < header_size) return false;
+    mode = *p++;
+    raw_size = get32(p);
+    coded_size = get32(p);
+    crc = get32(p);
+    return mode <= run && coded_size <= size_t(end - p);
+  }
+
+  template <class OutIter>
+  static void put32(OutIter &dest, uint32_t value) {
+    for (int i = 0; i != 4; ++i) {
+      *dest++ = uint8_t(value >> (i * 8));
+    }
+  }
+
+  template <class InIter>
+  static uint32_t get32(InIter &p) {
+    uint32_t value = 0;
+    for (int i = 0; i != 4; ++i) {
+      value |= uint32_t(*p++ & 0xff) << (i * 8);
+    }
+    return value;
+  }
+};
+
+// 7 bit variable length integers.
+template <class OutIter>
+bool put_varint(OutIter &dest, OutIter destmax, uint64_t value) {
+  do {
+    if (dest == destmax) return false;
+    *dest++ = uint8_t(value >= 0x80 ? (value & 0x7f) | 0x80 : value);
+    value >>= 7;
+  } while (value);
+  return true;
+}
+
+template <class InIter>
+bool get_varint(InIter &p, InIter end, uint64_t &value) {
+  value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (p == end) return false;
+    uint8_t byte = *p++;
+    value |= uint64_t(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) return true;
+  }
+  return false;
+}
+
+#endif
@@ -1,74 +1,311 @@
+#ifndef _RANGE_DECODER_HPP_INCLUDED_
+#define _RANGE_DECODER_HPP_INCLUDED_
+
 #include <cstdint>
 #include <stdio.h>
 #include <array>
 #include <algorithm>
+#include <vector>
+#include <string.h>
+
+#ifdef _MSC_VER
+  #include <intrin.h>
+#endif
+
+#include "checksum.hpp"
+#include "range_block.hpp"
 
 // see https://en.wikipedia.org/wiki/Range_encoding
 
-template <class Context, class InIter, class OutIter>
-OutIter
-range_decoder(Context &ctxt, OutIter dest, OutIter destmax, InIter begin, InIter end) {
-  constexpr int shift = 64 - 8;
+// the eight bytes at p as a big endian number.
+inline uint64_t range_load_be64(const uint8_t *p) {
+  #if defined(__GNUC__) || defined(__clang__)
+    uint64_t value;
+    memcpy(&value, p, 8);
+    return __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ ? __builtin_bswap64(value) : value;
+  #elif defined(_MSC_VER)
+    uint64_t value;
+    memcpy(&value, p, 8);
+    return _byteswap_uint64(value);
+  #else
+    uint64_t value = 0;
+    for (int i = 0; i != 8; ++i) value = value << 8 | p[i];
+    return value;
+  #endif
+}
+
+// leading zero bits of a non-zero value.
+inline int range_clz64(uint64_t value) {
+  #if defined(__GNUC__) || defined(__clang__)
+    return __builtin_clzll(value);
+  #elif defined(_MSC_VER) && defined(_M_X64)
+    unsigned long index;
+    _BitScanReverse64(&index, value);
+    return 63 - int(index);
+  #else
+    int n = 0;
+    while (!(value >> 63)) { value <<= 1; ++n; }
+    return n;
+  #endif
+}
+
+// the low/range/code state of the decoder between symbols.
+// next() returns the next input byte or -1 at the end of the input.
+struct range_decoder_state {
   typedef uint64_t acc_t;
-  acc_t low = 0;
-  acc_t range = ~(uint64_t)0;
+  static constexpr int shift = 64 - 8;
+  static constexpr uint32_t total = 0x10000;
 
-  acc_t mask = ctxt.mask;
-  auto p = begin;
+  acc_t low = 0;
+  acc_t range = ~(acc_t)0;
   acc_t code = 0;
-  for (int i = 0; i != sizeof(acc_t); ++i) {
-    if (p == end) return destmax;
-    code = code * 0x100 + (*p++ & 0xff);
-  }
+  acc_t divisor = 0;
 
-  constexpr size_t total = 0x10000;
-  printf("size=%ld total=%ld\n", long(ctxt.size), long(total));
-
-  auto &symbols = *new std::array<uint8_t, 65536>{};
-  for (int i = 0, sym = 0; sym != mask+1; ++sym) {
-    acc_t size = ctxt.starts[sym+1] - ctxt.starts[sym];
-    for (acc_t j = 0; j != size; ++j) {
-      symbols[i++] = sym;
+  template <class Next>
+  bool init(Next &&next) {
+    for (int i = 0; i != sizeof(acc_t); ++i) {
+      int byte = next();
+      if (byte < 0) return false;
+      code = code * 0x100 + byte;
     }
+    return true;
   }
 
-  size_t max_size = std::min(ctxt.size, size_t(destmax - dest));
-  for (int i = 0; i != max_size; ++i) {
-    acc_t divisor = range / total;
-    acc_t value = (code - low) / divisor;
-    uint8_t symbol = symbols[(size_t)value];
-    uint32_t start = ctxt.starts[symbol];
-    uint32_t size = ctxt.starts[symbol+1] - ctxt.starts[symbol];
+  // update_unchecked() reads at most this many bytes.
+  static const size_t max_update_bytes = 9;
 
+  // the position in [0, total) of the next symbol. Corrupt input may give a larger value.
+  acc_t value() {
+    divisor = range / total;
+    return divisor ? (code - low) / divisor : total;
+  }
+
+  // remove the symbol occupying [start, start+size) returned by value().
+  template <class Next>
+  bool update(uint32_t start, uint32_t size, Next &&next) {
     range = divisor;
     low += start * range;
     range *= size;
 
-    //printf("%02x [%04x..%04x] range=%016lx..%016lx [%016lx]\n", symbol, start, start+size, long(low), long(low+range), long(range));
-    
-    *dest++ = symbol;
+    //printf("[%04x..%04x] range=%016lx..%016lx [%016lx]\n", start, start+size, long(low), long(low+range), long(range));
 
     // if the top byte is the same, output the byte and increase the range
     while ((low >> shift) == ((low + range) >> shift)) {
-      if (p == end) { ctxt.error(i, "input overrun 1"); goto finish; }
-      code = code * 0x100 + (*p++ & 0xff);
+      int byte = next();
+      if (byte < 0) return false;
+      code = code * 0x100 + byte;
       low <<= 8;
       range <<= 8;
     }
 
     // if the range is too small, output some bytes and increase the range.
     if (range < 0x10000) {
-      if (p == end) { ctxt.error(i, "input overrun 1"); goto finish; }
-      code = code * 0x100 + (*p++ & 0xff);
-      if (p == end) { ctxt.error(i, "input overrun 1"); goto finish; }
-      code = code * 0x100 + (*p++ & 0xff);
+      int byte = next();
+      if (byte < 0) return false;
+      code = code * 0x100 + byte;
+      byte = next();
+      if (byte < 0) return false;
+      code = code * 0x100 + byte;
+      low <<= 16;
+      range = ~low;
+    }
+    return true;
+  }
+
+  // update() for when max_update_bytes can be read at p.
+  // The top bytes that low and low + range agree on are shifted out together.
+  void update_unchecked(uint32_t start, uint32_t size, const uint8_t *&p) {
+    range = divisor;
+    low += start * range;
+    range *= size;
+
+    int bits = range_clz64(low ^ (low + range)) & ~7;
+    code = code << bits | (range_load_be64(p) >> 1) >> (63 - bits);
+    low <<= bits;
+    range <<= bits;
+    p += bits / 8;
+
+    if (range < 0x10000) {
+      code = code << 16 | uint32_t(p[0]) << 8 | p[1];
+      p += 2;
       low <<= 16;
       range = ~low;
     }
   }
-finish:
+};
+
+// decodes blocks written by range_encode_block.
+class range_block_decoder {
+public:
+  // decode the block at p to dest, advancing both.
+  // offset is the position of the block in the output for error messages.
+  template <class Context, class InIter, class OutIter>
+  bool decode(Context &ctxt, size_t offset, OutIter &dest, OutIter destmax, InIter &p, InIter end) {
+    range_block block;
+    if (!block.read(p, end)) { ctxt.error(offset, "bad block header"); return false; }
+    if (block.raw_size == 0 || block.raw_size > size_t(destmax - dest)) { ctxt.error(offset, "block too large"); return false; }
+
+    auto block_start = dest;
+    auto block_end = dest + block.raw_size;
+    auto data_end = p + block.coded_size;
+    auto next = [&]() { return p == data_end ? -1 : int(*p++ & 0xff); };
+    range_decoder_state state;
+
+    if (block.mode == range_block::stored) {
+      if (block.coded_size != block.raw_size) { ctxt.error(offset, "bad block header"); return false; }
+      dest = std::copy(p, data_end, dest);
+    } else if (block.mode == range_block::coded) {
+      table &symbols = tables_[0];
+      if (!symbols.read(p, data_end) || symbols.empty()) { ctxt.error(offset, "bad table"); return false; }
+      if (!state.init(next)) { ctxt.error(offset, "input overrun"); return false; }
+
+      // the checked loop finishes the block and reports any error.
+      size_t i = decode_unchecked(symbols, state, dest, block.raw_size, p, data_end);
+      for (; i != block.raw_size; ++i) {
+        int symbol = symbols.decode(state, next);
+        if (symbol < 0) { ctxt.error(offset + i, "corrupt input"); return false; }
+        *dest++ = uint8_t(symbol);
+      }
+    } else {
+      if (p == data_end) { ctxt.error(offset, "bad table"); return false; }
+      uint8_t dominant = *p++;
+      table &literals = tables_[0];
+      table &lengths = tables_[1];
+      if (!literals.read(p, data_end) || !lengths.read(p, data_end) || lengths.empty()) { ctxt.error(offset, "bad table"); return false; }
+      if (!state.init(next)) { ctxt.error(offset, "input overrun"); return false; }
+
+      for (;;) {
+        uint64_t run = 0;
+        for (int shift = 0; ; shift += 7) {
+          int byte = lengths.decode(state, next);
+          if (byte < 0 || shift > 28) { ctxt.error(offset + (dest - block_start), "corrupt input"); return false; }
+          run |= uint64_t(byte & 0x7f) << shift;
+          if (!(byte & 0x80)) break;
+        }
+        if (run > size_t(block_end - dest)) { ctxt.error(offset + (dest - block_start), "corrupt input"); return false; }
+        dest = std::fill_n(dest, size_t(run), dominant);
+        if (dest == block_end) break;
+
+        int literal = literals.empty() ? -1 : literals.decode(state, next);
+        if (literal < 0) { ctxt.error(offset + (dest - block_start), "corrupt input"); return false; }
+        *dest++ = uint8_t(literal);
+      }
+    }
+    p = data_end;
+
+    // verify the block while it is still in cache.
+    if (crc32c(&*block_start, block.raw_size) != block.crc) {
+      ctxt.error(offset, "checksum mismatch");
+      dest = block_start;
+      return false;
+    }
+    return true;
+  }
+
+private:
+  class table;
+
+  // decode up to count symbols without checking for the end of the input,
+  // in batches that can not read past end. Returns the number decoded.
+  template <class OutIter, class Byte>
+  static size_t decode_unchecked(table &symbols, range_decoder_state &state, OutIter &dest, size_t count, Byte *&p, Byte *end) {
+    const uint8_t *q = (const uint8_t *)p;
+    size_t done = 0;
+    while (done != count) {
+      size_t batch = std::min(count - done, size_t(end - p) / range_decoder_state::max_update_bytes);
+      if (batch == 0) break;
+      for (size_t i = 0; i != batch; ++i) {
+        int symbol = symbols.decode_unchecked(state, q);
+        if (symbol < 0) {
+          p += q - (const uint8_t *)p;
+          return done + i;
+        }
+        *dest++ = uint8_t(symbol);
+      }
+      p += q - (const uint8_t *)p;
+      done += batch;
+    }
+    return done;
+  }
+
+  // other iterators take the checked path.
+  template <class OutIter, class InIter>
+  static size_t decode_unchecked(table &, range_decoder_state &, OutIter &, size_t, InIter &, InIter) {
+    return 0;
+  }
+
+  // the frequency table of a block and a lookup from value to symbol.
+  class table {
+  public:
+    table() : symbols_(range_decoder_state::total) {}
+
+    bool empty() const { return starts_[256] == 0; }
+
+    // a table with no symbols is valid but can not be decoded from.
+    template <class InIter>
+    bool read(InIter &p, InIter end) {
+      if (size_t(end - p) < 32) return false;
+      auto present = p;
+      p += 32;
+      uint32_t start = 0;
+      for (uint32_t sym = 0; sym != 256; ++sym) {
+        starts_[sym] = start;
+        if (present[sym >> 3] & (1 << (sym & 7))) {
+          if (size_t(end - p) < 2) return false;
+          uint32_t size = (p[0] & 0xff) + (p[1] & 0xff) * 0x100 + 1;
+          p += 2;
+          if (start + size > range_decoder_state::total) return false;
+          std::fill(symbols_.begin() + start, symbols_.begin() + start + size, uint8_t(sym));
+          start += size;
+        }
+      }
+      starts_[256] = start;
+      return start == range_decoder_state::total || start == 0;
+    }
+
+    // the next symbol or -1 if the input is corrupt.
+    template <class Next>
+    int decode(range_decoder_state &state, Next &next) {
+      auto value = state.value();
+      if (value >= range_decoder_state::total) return -1;
+      uint8_t symbol = symbols_[(size_t)value];
+      uint32_t start = starts_[symbol];
+      if (!state.update(start, starts_[symbol+1] - start, next)) return -1;
+      return symbol;
+    }
+
+    int decode_unchecked(range_decoder_state &state, const uint8_t *&p) {
+      auto value = state.value();
+      if (value >= range_decoder_state::total) return -1;
+      uint8_t symbol = symbols_[(size_t)value];
+      uint32_t start = starts_[symbol];
+      state.update_unchecked(start, starts_[symbol+1] - start, p);
+      return symbol;
+    }
+
+  private:
+    std::array<uint32_t, 257> starts_;
+    std::vector<uint8_t> symbols_;
+  };
+
+  table tables_[2];
+};
+
+template <class Context, class InIter, class OutIter>
+OutIter
+range_decoder(Context &ctxt, OutIter dest, OutIter destmax, InIter begin, InIter end) {
+  range_block_decoder decoder;
+
+  size_t max_size = std::min(ctxt.size, size_t(destmax - dest));
+  auto out = dest + max_size;
+  auto p = begin;
+  for (size_t offset = 0; offset != max_size; ) {
+    auto block_start = dest;
+    if (!decoder.decode(ctxt, offset, dest, out, p, end)) break;
+    offset += dest - block_start;
+  }
 
-  delete &symbols;
   return dest;
 }
 
+#endif
@@ -1,140 +1,356 @@
+#ifndef _RANGE_ENCODER_HPP_INCLUDED_
+#define _RANGE_ENCODER_HPP_INCLUDED_
+
 #include <cstdint>
 #include <stdio.h>
 #include <array>
 #include <algorithm>
+#include <vector>
+#include <queue>
+#include <tuple>
+#include <functional>
+#include <cmath>
+#include <string.h>
+
+#include "checksum.hpp"
+#include "range_block.hpp"
+
+#if defined(_MSC_VER)
+  #include <xmmintrin.h>
+  #define RC_PREFETCH(p) _mm_prefetch((const char *)(p), _MM_HINT_T0)
+#else
+  #define RC_PREFETCH(p) __builtin_prefetch(p)
+#endif
 
 // see https://en.wikipedia.org/wiki/Range_encoding
 
-// limit the total of an array to 64k
+// scale the counts in sizes so that they add up to exactly target.
+// Present symbols keep a size of at least one and the coded size,
+// sum(count * log2(target / size)), is minimised.
+//
+// The sizes start as the rounded down scaled counts and units are then
+// added to or removed from the symbols that gain or lose the least
+// bits until the total is right. Because the cost is convex in each
+// size this is optimal when no exchange of a unit between two symbols
+// reduces the cost, which a few swaps at the end make sure of.
 template <class Sizes>
-void limit_total_to_64k(Sizes &sizes, size_t total) {
+void normalize_frequencies(Sizes &sizes, size_t total, size_t target = 0x10000) {
   size_t num_symbols = sizes.size();
+  if (total == 0) return;
 
-  int shift = 0;
-  while ((total >> shift) >= 0x20000) {
-    shift++;
-  }
+  std::vector<size_t> counts(sizes.begin(), sizes.end());
 
-  while ((total << -shift) < 0x10000) {
-    shift--;
+  double scale = double(target) / double(total);
+  size_t sum = 0;
+  for (size_t i = 0; i != num_symbols; ++i) {
+    if (counts[i]) {
+      sizes[i] = std::max(size_t(1), size_t(counts[i] * scale));
+      sum += sizes[i];
+    }
   }
 
-  //for (size_t i = 0; i != num_symbols; ++i) {
-  //  if (sizes[i]) printf("[%02x %d]", int(i), int(sizes[i]));
-  //}
-  //printf("initial: total=%08lx\n", long(total));
+  // bits saved by adding one to sizes[i] and lost by taking one away.
+  auto gain = [&](size_t i) {
+    return counts[i] * std::log2(double(sizes[i] + 1) / double(sizes[i]));
+  };
+  auto loss = [&](size_t i) {
+    return sizes[i] > 1 ? counts[i] * std::log2(double(sizes[i]) / double(sizes[i] - 1)) : HUGE_VAL;
+  };
 
-  total = 0;
+  // heap entries are (bits, symbol, size when pushed). Entries for symbols
+  // that have changed since are stale and get refreshed when they come up.
+  typedef std::tuple<double, size_t, size_t> entry_t;
+  std::priority_queue<entry_t> gains;
+  std::priority_queue<entry_t, std::vector<entry_t>, std::greater<entry_t>> losses;
   for (size_t i = 0; i != num_symbols; ++i) {
-    auto size = sizes[i];
-    if (size) {
-      if (shift < 0) {
-        sizes[i] = size << -shift;
-      } else {
-        sizes[i] = (size >> shift) ? size >> shift : 1;
-      }
-      total += sizes[i];
+    if (counts[i]) {
+      gains.emplace(gain(i), i, sizes[i]);
+      losses.emplace(loss(i), i, sizes[i]);
     }
   }
-  //printf("first pass: total=%08lx\n", long(total));
 
-  size_t pass = 0;
-  while (total > 0x10000 && pass++ < 20) {
-    for (size_t i = 0; i != num_symbols && total > 0x10000; ++i) {
-      auto size = sizes[i];
-      if (size > 1) {
-        size_t delta = size - size * 0x10000 / total;
-        if (total - delta < 0x10000) {
-          delta = total - 0x10000;
-        }
-        total -= delta; 
-        sizes[i] -= delta;
-      }
+  auto best_gain = [&]() {
+    while (std::get<2>(gains.top()) != sizes[std::get<1>(gains.top())]) {
+      size_t i = std::get<1>(gains.top());
+      gains.pop();
+      gains.emplace(gain(i), i, sizes[i]);
     }
-    //for (size_t i = 0; i != num_symbols; ++i) {
-    //  if (sizes[i]) printf("[%02x %d]", int(i), int(sizes[i]));
-    //}
-    //printf("pass %d: total=%08lx\n", int(pass), long(total));
-  }
-}
-
-
-
-template <class Context, class InIter, class OutIter, uint32_t SymBits=8>
-OutIter
-range_encoder(Context &ctxt, OutIter dest, OutIter destmax, InIter begin, InIter end) {
-  constexpr uint32_t mask = ctxt.mask;
-
-  printf("start\n");
-  std::array<size_t, mask+1> sizes;
-  
-  std::fill(sizes.begin(), sizes.end(), 0);
+    return gains.top();
+  };
+  auto best_loss = [&]() {
+    while (std::get<2>(losses.top()) != sizes[std::get<1>(losses.top())]) {
+      size_t i = std::get<1>(losses.top());
+      losses.pop();
+      losses.emplace(loss(i), i, sizes[i]);
+    }
+    return losses.top();
+  };
+  auto add = [&](size_t i, int delta) {
+    sizes[i] += delta;
+    gains.emplace(gain(i), i, sizes[i]);
+    losses.emplace(loss(i), i, sizes[i]);
+  };
 
-  for (auto p = begin; p != end; ++p) {
-    sizes[*p & mask]++;
+  for (; sum < target; ++sum) {
+    add(std::get<1>(best_gain()), 1);
   }
-
-  size_t size = size_t(end - begin);
-
-  limit_total_to_64k(sizes, size);
-  constexpr size_t total = 0x10000;
-
-  printf("calculated size=%ld / total=%ld\n", long(size), long(total));
-
-  ctxt.size = size;
-  for (uint32_t i = 0, start = 0; i != mask+1; ++i) {
-    ctxt.starts[i] = start;
-    start += (uint32_t)sizes[i];
+  for (; sum > target; --sum) {
+    add(std::get<1>(best_loss()), -1);
   }
-  ctxt.starts[mask+1] = uint32_t(total);
+  for (size_t swaps = 0; swaps != num_symbols; ++swaps) {
+    entry_t g = best_gain(), l = best_loss();
+    if (std::get<0>(g) <= std::get<0>(l) || std::get<1>(g) == std::get<1>(l)) break;
+    add(std::get<1>(g), 1);
+    add(std::get<1>(l), -1);
+  }
+}
 
-  constexpr int shift = 64 - 8;
+// the low/range state of the encoder between symbols.
+// emit(byte) writes a byte and returns false if there is no more room.
+struct range_encoder_state {
   typedef uint64_t acc_t;
+  static constexpr int shift = 64 - 8;
+  static constexpr uint32_t total = 0x10000;
+
   acc_t low = 0;
-  acc_t range = ~(uint64_t)0;
-  for (auto p = begin; p != end; ++p) {
-    auto start = ctxt.starts[*p & mask];
-    auto size = (uint32_t)sizes[*p & mask];
+  acc_t range = ~(acc_t)0;
 
+  // code the symbol occupying [start, start+size) of total.
+  template <class Emit>
+  bool put(uint32_t start, uint32_t size, Emit &&emit) {
     range /= total;
     low += start * range;
     range *= size;
 
-    //printf("%02x start=%04x size=%04x\n", *p & mask, start, size);
-    //printf("%02x [%04lx..%04lx] range=%016lx..%016lx [%016lx]\n", *p & mask, long(start), long(start+size), long(low), long(low+range), long(range));
+    //printf("[%04lx..%04lx] range=%016lx..%016lx [%016lx]\n", long(start), long(start+size), long(low), long(low+range), long(range));
 
     // if the top byte is the same output the byte and increase the range
     while ((low >> shift) == ((low + range) >> shift)) {
-      //printf("%02x\n", uint8_t(low >> shift));
-      *dest++ = uint8_t(low >> shift);
-      if (dest >= destmax) return dest;
+      if (!emit(uint8_t(low >> shift))) return false;
       low <<= 8;
       range <<= 8;
     }
 
     // if the range is too small, output some bytes and increase the range.
     if (range < 0x10000ll) {
-      //printf("overflow\n");
-      *dest++ = uint8_t(low >> shift);
-      if (dest >= destmax) return dest;
+      if (!emit(uint8_t(low >> shift))) return false;
       low <<= 8;
-      *dest++ = uint8_t(low >> shift);
-      if (dest >= destmax) return dest;
+      if (!emit(uint8_t(low >> shift))) return false;
       low <<= 8;
       range = ~low;
     }
+    return true;
+  }
+
+  // write a whole value inside the final range so that the decoder
+  // never has to read past the end of the stream.
+  template <class Emit>
+  bool flush(Emit &&emit) {
+    low += range >> 1;
+    for (int i = 0; i != sizeof(acc_t); ++i) {
+      if (!emit(uint8_t(low >> shift))) return false;
+      low <<= 8;
+    }
+    return true;
+  }
+
+  // write as few bytes as possible. The decoder must read zeros past the end.
+  template <class Emit>
+  bool flush_short(Emit &&emit) {
+    for (int bytes = 1; bytes != sizeof(acc_t); ++bytes) {
+      acc_t unit = (acc_t)1 << (64 - bytes * 8);
+      acc_t value = (low + unit - 1) & ~(unit - 1);
+      if (value >= low && value - low < range) {
+        for (int i = 0; i != bytes; ++i) {
+          if (!emit(uint8_t(value >> shift))) return false;
+          value <<= 8;
+        }
+        return true;
+      }
+    }
+    return flush(emit);
+  }
+};
+
+// count the symbols in a block. Four banks of counters keep runs of the
+// same byte from stalling on the previous increment.
+template <class InIter>
+void range_histogram(std::array<size_t, 256> &sizes, InIter begin, InIter end) {
+  std::array<std::array<uint32_t, 256>, 4> banks{};
+  auto p = begin;
+  for (; end - p >= 4; p += 4) {
+    banks[0][p[0] & 0xff]++;
+    banks[1][p[1] & 0xff]++;
+    banks[2][p[2] & 0xff]++;
+    banks[3][p[3] & 0xff]++;
+  }
+  for (; p != end; ++p) {
+    banks[0][*p & 0xff]++;
+  }
+  for (size_t i = 0; i != 256; ++i) {
+    sizes[i] = size_t(banks[0][i]) + banks[1][i] + banks[2][i] + banks[3][i];
+  }
+}
+
+// normalise sizes and write them as a table, see range_block.hpp.
+template <class Emit>
+bool range_write_table(Emit &emit, std::array<size_t, 256> &sizes, size_t total, std::array<uint32_t, 257> &starts) {
+  normalize_frequencies(sizes, total);
+
+  std::array<uint8_t, 32> present{};
+  for (uint32_t i = 0, start = 0; i != 256; ++i) {
+    starts[i] = start;
+    start += (uint32_t)sizes[i];
+    if (sizes[i]) present[i >> 3] |= 1 << (i & 7);
+  }
+  starts[256] = range_encoder_state::total;
+
+  for (size_t i = 0; i != present.size(); ++i) {
+    if (!emit(present[i])) return false;
+  }
+  for (uint32_t i = 0; i != 256; ++i) {
+    if (sizes[i]) {
+      if (!emit(uint8_t(sizes[i] - 1)) || !emit(uint8_t((sizes[i] - 1) >> 8))) return false;
+    }
+  }
+  return true;
+}
+
+// the length of the run of value starting at p.
+template <class InIter>
+size_t range_run_length(InIter begin, InIter end, uint8_t value) {
+  uint64_t pattern = value * 0x0101010101010101ull;
+  auto p = begin;
+  for (; end - p >= 8; p += 8) {
+    uint64_t word;
+    memcpy(&word, &*p, 8);
+    if (word != pattern) break;
+  }
+  while (p != end && uint8_t(*p) == value) ++p;
+  return size_t(p - begin);
+}
+
+// code a block as runs of the dominant symbol, each followed by a literal.
+// The run lengths are coded as 7 bit varint bytes with their own table.
+template <class Emit, class InIter>
+bool range_encode_runs(Emit &emit, InIter begin, InIter end, uint8_t dominant) {
+  std::vector<uint32_t> runs;
+  std::vector<uint8_t> literals;
+  for (auto p = begin; ; ) {
+    size_t run = range_run_length(p, end, dominant);
+    runs.push_back(uint32_t(run));
+    p += run;
+    if (p == end) break;
+    literals.push_back(*p++);
   }
 
-  while (range < 0x10000) {
-    *dest++ = uint8_t(low >> shift);
-    if (dest >= destmax) return dest;
-    low <<= 8;
-    range <<= 8;
+  std::array<size_t, 256> literal_sizes{}, length_sizes{};
+  size_t num_length_bytes = 0;
+  for (uint8_t literal : literals) {
+    literal_sizes[literal]++;
   }
+  for (uint32_t run : runs) {
+    do {
+      length_sizes[run >= 0x80 ? (run & 0x7f) | 0x80 : run]++;
+      num_length_bytes++;
+      run >>= 7;
+    } while (run);
+  }
+
+  std::array<uint32_t, 257> literal_starts, length_starts;
+  if (!emit(dominant)) return false;
+  if (!range_write_table(emit, literal_sizes, literals.size(), literal_starts)) return false;
+  if (!range_write_table(emit, length_sizes, num_length_bytes, length_starts)) return false;
 
-  low += ((acc_t)1 << shift);
-  *dest++ = uint8_t(low >> shift);
+  range_encoder_state state;
+  for (size_t i = 0; i != runs.size(); ++i) {
+    uint32_t run = runs[i];
+    do {
+      uint32_t sym = run >= 0x80 ? (run & 0x7f) | 0x80 : run;
+      if (!state.put(length_starts[sym], length_starts[sym+1] - length_starts[sym], emit)) return false;
+      run >>= 7;
+    } while (run);
+    if (i != literals.size()) {
+      uint32_t sym = literals[i];
+      if (!state.put(literal_starts[sym], literal_starts[sym+1] - literal_starts[sym], emit)) return false;
+    }
+  }
+  return state.flush(emit);
+}
+
+// code one block, see range_block.hpp.
+// [end, next_end) is the following block which is prefetched while this one is coded.
+// returns destmax if there is not enough room.
+template <class InIter, class OutIter>
+OutIter
+range_encode_block(OutIter dest, OutIter destmax, InIter begin, InIter end, InIter next_end) {
+  range_block block;
+  block.raw_size = uint32_t(end - begin);
+  if (size_t(destmax - dest) <= range_block::header_size) return destmax;
+
+  // the histogram and checksum bring the block into cache for the coder.
+  std::array<size_t, 256> sizes;
+  range_histogram(sizes, begin, end);
+  block.crc = crc32c(&*begin, block.raw_size);
+
+  auto header = dest;
+  auto data = dest + range_block::header_size;
+  dest = data;
+
+  // if the coded data would be larger than the input, store it instead.
+  OutIter limit = size_t(destmax - data) > block.raw_size ? data + block.raw_size : destmax;
+  auto emit = [&](uint8_t byte) { *dest++ = byte; return dest < limit; };
+
+  // when one symbol dominates, code runs of it instead of every symbol.
+  uint8_t dominant = uint8_t(std::max_element(sizes.begin(), sizes.end()) - sizes.begin());
+  bool fits;
+  if (sizes[dominant] >= block.raw_size - block.raw_size / 8) {
+    block.mode = range_block::run;
+    fits = range_encode_runs(emit, begin, end, dominant);
+  } else {
+    block.mode = range_block::coded;
+    std::array<uint32_t, 257> starts;
+    fits = range_write_table(emit, sizes, block.raw_size, starts);
+
+    if (fits) {
+      range_encoder_state state;
+      size_t prefetch_size = size_t(next_end - end);
+      auto p = begin;
+      for (size_t i = 0; i != block.raw_size && fits; ++i, ++p) {
+        if ((i & 63) == 0 && i < prefetch_size) RC_PREFETCH(&*(end + i));
+        auto sym = *p & 0xff;
+        fits = state.put(starts[sym], uint32_t(sizes[sym]), emit);
+      }
+      fits = fits && state.flush(emit);
+    }
+  }
+
+  if (fits) {
+    block.coded_size = uint32_t(dest - data);
+  } else {
+    if (size_t(destmax - data) <= block.raw_size) return destmax;
+    block.mode = range_block::stored;
+    block.coded_size = block.raw_size;
+    dest = std::copy(begin, end, data);
+  }
+  block.write(header);
+  return dest;
+}
+
+template <class Context, class InIter, class OutIter, uint32_t SymBits=8>
+OutIter
+range_encoder(Context &ctxt, OutIter dest, OutIter destmax, InIter begin, InIter end, size_t block_size = range_block::default_size) {
+  ctxt.size = size_t(end - begin);
+
+  for (auto block = begin; block != end; ) {
+    auto block_end = block + std::min(size_t(end - block), block_size);
+    auto next_end = block_end + std::min(size_t(end - block_end), block_size);
+    dest = range_encode_block(dest, destmax, block, block_end, next_end);
+    if (dest == destmax) return destmax;
+    block = block_end;
+  }
 
   return dest;
 }
 
+#endif
@@ -0,0 +1,218 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Scatter-gather range coding.
+//
+// range_encoder and range_decoder work on contiguous buffers. These versions
+// take the input and output as lists of segments, like struct iovec, so that
+// chains of network buffers can be coded without flattening them first.
+//
+// Blocks record their own raw size so the encoder is free to end a block
+// at the end of an input segment. Blocks that lie inside one segment are
+// coded in place. Only a short tail of a segment is gathered into a staging
+// block together with the start of the following segments, and only a block
+// that straddles an output segment is coded to a staging buffer and copied.
+//
+// The output is the same stream as range_encoder writes.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef _RANGE_SEGMENTS_HPP_INCLUDED_
+#define _RANGE_SEGMENTS_HPP_INCLUDED_
+
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+
+#include "range_encoder.hpp"
+#include "range_decoder.hpp"
+
+// one contiguous piece of a scattered buffer.
+template <class Byte>
+struct range_segment {
+  Byte *data;
+  size_t size;
+};
+
+typedef range_segment<const uint8_t> range_input_segment;
+typedef range_segment<uint8_t> range_output_segment;
+
+// a position in a list of segments. Empty segments are skipped.
+template <class Byte>
+class range_segment_cursor {
+public:
+  range_segment_cursor(const range_segment<Byte> *begin, size_t num_segments) :
+    segment_(begin), end_(begin + num_segments)
+  {
+    for (auto s = segment_; s != end_; ++s) remaining_ += s->size;
+    skip_empty();
+  }
+
+  bool at_end() const { return segment_ == end_; }
+
+  // the contiguous bytes at the cursor.
+  Byte *data() const { return segment_->data + offset_; }
+  size_t available() const { return at_end() ? 0 : segment_->size - offset_; }
+
+  // all the bytes after the cursor.
+  size_t remaining() const { return remaining_; }
+
+  // move forward n bytes, which must be no more than remaining().
+  void advance(size_t n) {
+    remaining_ -= n;
+    while (n) {
+      size_t step = std::min(n, available());
+      offset_ += step;
+      n -= step;
+      skip_empty();
+    }
+  }
+
+  // copy n bytes from the cursor to dest and advance.
+  template <class OutIter>
+  OutIter read(OutIter dest, size_t n) {
+    while (n) {
+      size_t step = std::min(n, available());
+      dest = std::copy(data(), data() + step, dest);
+      advance(step);
+      n -= step;
+    }
+    return dest;
+  }
+
+  // copy n bytes from src to the cursor and advance.
+  template <class InIter>
+  void write(InIter src, size_t n) {
+    while (n) {
+      size_t step = std::min(n, available());
+      std::copy(src, src + step, data());
+      src += step;
+      advance(step);
+      n -= step;
+    }
+  }
+
+  // copy n bytes from the cursor to dest without advancing.
+  template <class OutIter>
+  OutIter peek(OutIter dest, size_t n) const {
+    range_segment_cursor copy = *this;
+    return copy.read(dest, n);
+  }
+
+private:
+  void skip_empty() {
+    while (segment_ != end_ && offset_ == segment_->size) {
+      ++segment_;
+      offset_ = 0;
+    }
+  }
+
+  const range_segment<Byte> *segment_;
+  const range_segment<Byte> *end_;
+  size_t offset_ = 0;
+  size_t remaining_ = 0;
+};
+
+// code the input segments to the output segments.
+// returns the number of bytes written or the total size of the output if there is not enough room.
+template <class Context>
+size_t range_encoder(Context &ctxt, const range_output_segment *out, size_t num_out, const range_input_segment *in, size_t num_in, size_t block_size = range_block::default_size) {
+  range_segment_cursor<const uint8_t> src(in, num_in);
+  range_segment_cursor<uint8_t> dest(out, num_out);
+  size_t capacity = dest.remaining();
+  ctxt.size = src.remaining();
+
+  // segment tails shorter than this are gathered with the following data.
+  size_t min_block = block_size / 4;
+  std::vector<uint8_t> gather;
+  std::vector<uint8_t> stage;
+
+  size_t written = 0;
+  for (size_t left = ctxt.size; left != 0; ) {
+    const uint8_t *block;
+    size_t size = std::min(src.available(), block_size);
+    if (size >= min_block || size == left) {
+      block = src.data();
+    } else {
+      size = std::min(left, block_size);
+      gather.resize(size);
+      src.peek(gather.data(), size);
+      block = gather.data();
+    }
+
+    // code in place if the block fits the output segment.
+    size_t bound = range_block::bound(size, block_size);
+    uint8_t *block_dest = dest.available() >= bound ? dest.data() : nullptr;
+    if (!block_dest) {
+      stage.resize(bound);
+      block_dest = stage.data();
+    }
+    uint8_t *block_end = range_encode_block(block_dest, block_dest + bound, block, block + size, block + size);
+    size_t coded = size_t(block_end - block_dest);
+    if (coded >= capacity - written) return capacity;
+    if (block_dest == stage.data()) {
+      dest.write(stage.data(), coded);
+    } else {
+      dest.advance(coded);
+    }
+
+    written += coded;
+    src.advance(size);
+    left -= size;
+  }
+
+  return written;
+}
+
+// decode the input segments, written by either encoder, to the output segments.
+// returns the number of bytes decoded, which is less than ctxt.size on error.
+template <class Context>
+size_t range_decoder(Context &ctxt, const range_output_segment *out, size_t num_out, const range_input_segment *in, size_t num_in) {
+  range_segment_cursor<const uint8_t> src(in, num_in);
+  range_segment_cursor<uint8_t> dest(out, num_out);
+  size_t max_size = std::min(ctxt.size, dest.remaining());
+
+  range_block_decoder decoder;
+  std::vector<uint8_t> gather;
+  std::vector<uint8_t> stage;
+
+  size_t offset = 0;
+  while (offset != max_size) {
+    // the header gives the size of the whole block.
+    uint8_t header[range_block::header_size];
+    if (src.remaining() < sizeof(header)) { ctxt.error(offset, "bad block header"); break; }
+    src.peek(header, sizeof(header));
+    const uint8_t *h = header + 1;
+    size_t raw_size = range_block::get32(h);
+    size_t block_size = sizeof(header) + range_block::get32(h);
+    if (block_size > src.remaining()) { ctxt.error(offset, "bad block header"); break; }
+    raw_size = std::min(raw_size, max_size - offset);
+
+    const uint8_t *block = src.data();
+    if (src.available() < block_size) {
+      gather.resize(block_size);
+      src.peek(gather.data(), block_size);
+      block = gather.data();
+    }
+
+    // decode in place if the block fits the output segment.
+    bool in_place = dest.available() >= raw_size;
+    if (!in_place) stage.resize(raw_size);
+    uint8_t *block_dest = in_place ? dest.data() : stage.data();
+    uint8_t *block_end = block_dest;
+    auto p = block;
+    if (!decoder.decode(ctxt, offset, block_end, block_dest + raw_size, p, block + block_size)) break;
+
+    size_t decoded = size_t(block_end - block_dest);
+    if (in_place) {
+      dest.advance(decoded);
+    } else {
+      dest.write(stage.data(), decoded);
+    }
+    src.advance(block_size);
+    offset += decoded;
+  }
+
+  return offset;
+}
+
+#endif
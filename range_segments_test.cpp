@@ -0,0 +1,73 @@
+// round trips through the scatter-gather coder with input and output cut
+// into segments of many sizes.
+
+#include <stdio.h>
+#include <vector>
+#include <random>
+
+#include "range_segments.hpp"
+
+struct context {
+  size_t size;
+
+  void error(size_t, const char *) {}
+};
+
+template <class Byte>
+std::vector<range_segment<Byte>> cut(Byte *data, size_t size, size_t max_segment, std::mt19937 &rng) {
+  std::vector<range_segment<Byte>> result;
+  for (size_t pos = 0; pos < size; ) {
+    size_t n = std::min(size - pos, size_t(rng() % max_segment));
+    result.push_back({ data + pos, n });
+    pos += n;
+  }
+  return result;
+}
+
+int main() {
+  std::mt19937 rng(1);
+
+  // text-like data with some runs so that all the block modes are used.
+  std::vector<uint8_t> data(0x180000);
+  for (size_t i = 0; i != data.size(); ++i) {
+    data[i] = (i >> 16) % 3 == 0 ? 'x' : uint8_t('a' + rng() % 16);
+  }
+
+  static const size_t max_segments[] = { 100, 5000, 300000, 2000000 };
+  int failures = 0;
+  for (size_t max_segment : max_segments) {
+    context ctxt;
+    std::vector<uint8_t> coded(range_block::bound(data.size()));
+    auto in = cut((const uint8_t *)data.data(), data.size(), max_segment, rng);
+    auto out = cut(coded.data(), coded.size(), max_segment, rng);
+    size_t coded_size = range_encoder(ctxt, out.data(), out.size(), in.data(), in.size());
+
+    // the contiguous decoder reads the same stream.
+    std::vector<uint8_t> decoded(data.size());
+    ctxt.size = data.size();
+    auto end = range_decoder(ctxt, decoded.data(), decoded.data() + decoded.size(), coded.data(), coded.data() + coded_size);
+    if (end != decoded.data() + decoded.size() || decoded != data) {
+      printf("contiguous decode failed, segments up to %ld\n", long(max_segment));
+      ++failures;
+    }
+
+    std::vector<uint8_t> decoded2(data.size());
+    auto coded_in = cut((const uint8_t *)coded.data(), coded_size, max_segment, rng);
+    auto decoded_out = cut(decoded2.data(), decoded2.size(), max_segment, rng);
+    size_t decoded_size = range_decoder(ctxt, decoded_out.data(), decoded_out.size(), coded_in.data(), coded_in.size());
+    if (decoded_size != data.size() || decoded2 != data) {
+      printf("segmented decode failed, segments up to %ld\n", long(max_segment));
+      ++failures;
+    }
+
+    // not enough room for the output.
+    range_output_segment small = { coded.data(), coded_size / 2 };
+    if (range_encoder(ctxt, &small, 1, in.data(), in.size()) != small.size) {
+      printf("overflow not detected, segments up to %ld\n", long(max_segment));
+      ++failures;
+    }
+  }
+
+  printf("%s\n", failures ? "failed" : "ok");
+  return failures ? 1 : 0;
+}
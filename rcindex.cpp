@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "fm_index.hpp"
+#include "map.hpp"
+
+struct context {
+  void error(size_t offset, const char *msg) {
+    printf("%s @ %lx\n", msg, long(offset));
+  }
+};
+
+int usage() {
+  printf("usage: rcindex [-b block_size] [-s sample_rate] -o index file\n");
+  printf("       rcindex -c pattern index\n");
+  printf("       rcindex -l pattern index\n");
+  return 1;
+}
+
+int main(int argc, char **argv) {
+  fm_index::options opts;
+  char *index_name = nullptr;
+  char *pattern = nullptr;
+  char mode = 0;
+  std::vector<char *> filenames;
+
+  for (int i = 1; i < argc; ++i) {
+    char *arg = argv[i];
+    if (arg[0] == '-') {
+      if (!strcmp(arg+1, "b") && i + 1 < argc) {
+        opts.block_size = (size_t)strtoul(argv[++i], nullptr, 0);
+      } else if (!strcmp(arg+1, "s") && i + 1 < argc) {
+        opts.sample_rate = (uint32_t)strtoul(argv[++i], nullptr, 0);
+      } else if (!strcmp(arg+1, "o") && i + 1 < argc) {
+        index_name = argv[++i];
+      } else if ((!strcmp(arg+1, "c") || !strcmp(arg+1, "l")) && i + 1 < argc) {
+        mode = arg[1];
+        pattern = argv[++i];
+      } else {
+        return usage();
+      }
+    } else {
+      filenames.push_back(arg);
+    }
+  }
+
+  if (filenames.size() != 1 || !index_name == !pattern || opts.block_size == 0 || opts.block_size >= 0x80000000 || opts.sample_rate == 0) {
+    return usage();
+  }
+
+  map in_file(filenames[0], "r");
+  if (!in_file.data() && in_file.size()) {
+    printf("error: could not read %s\n", filenames[0]);
+    return 1;
+  }
+
+  if (index_name) {
+    std::vector<uint8_t> index;
+    fm_index::build(index, in_file.begin(), in_file.end(), opts);
+    map out_file(index_name, "w", index.size());
+    if (out_file.size() != index.size() || !out_file.data()) {
+      printf("error: could not write %s\n", index_name);
+      return 1;
+    }
+    memcpy(out_file.begin(), index.data(), index.size());
+    printf("indexed %ld bytes in %ld bytes\n", long(in_file.size()), long(index.size()));
+    return 0;
+  }
+
+  fm_index index;
+  if (!index.open(in_file.begin(), in_file.end())) {
+    printf("error: %s is not an index\n", filenames[0]);
+    return 1;
+  }
+
+  context ctxt;
+  size_t length = strlen(pattern);
+  if (length > index.overlap() + 1) {
+    printf("warning: matches of patterns longer than %ld bytes that cross a block boundary are not found\n", long(index.overlap() + 1));
+  }
+  if (mode == 'c') {
+    printf("%lld\n", (long long)index.count(ctxt, (const uint8_t *)pattern, length));
+  } else {
+    std::vector<uint64_t> positions;
+    index.locate(ctxt, positions, (const uint8_t *)pattern, length);
+    for (uint64_t pos : positions) {
+      printf("%lld\n", (long long)pos);
+    }
+  }
+}
@@ -0,0 +1,60 @@
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "model.hpp"
+#include "map.hpp"
+
+int usage() {
+  printf("usage: rctrain [-1] [-i id] -o model sample_files...\n");
+  return 1;
+}
+
+int main(int argc, char **argv) {
+  uint32_t order = 0;
+  uint32_t id = 0;
+  char *model_name = nullptr;
+  std::vector<char *> filenames;
+
+  for (int i = 1; i < argc; ++i) {
+    char *arg = argv[i];
+    if (arg[0] == '-') {
+      if (!strcmp(arg+1, "1")) {
+        order = 1;
+      } else if (!strcmp(arg+1, "i") && i + 1 < argc) {
+        id = (uint32_t)strtoul(argv[++i], nullptr, 0);
+      } else if (!strcmp(arg+1, "o") && i + 1 < argc) {
+        model_name = argv[++i];
+      } else {
+        return usage();
+      }
+    } else {
+      filenames.push_back(arg);
+    }
+  }
+
+  if (model_name == nullptr || filenames.empty()) {
+    return usage();
+  }
+
+  model m(id, order);
+  size_t total = 0;
+  for (auto filename : filenames) {
+    map in_file(filename, "r");
+    if (!in_file.data()) {
+      printf("error: could not read %s\n", filename);
+      return 1;
+    }
+    m.train(in_file.begin(), in_file.end());
+    total += in_file.size();
+  }
+  m.finish();
+
+  if (!m.save(model_name)) {
+    printf("error: could not write %s\n", model_name);
+    return 1;
+  }
+  printf("trained order %d model %d on %ld bytes\n", int(order), int(id), long(total));
+}
+
@@ -20,16 +20,169 @@
 #include <algorithm>
 #include <cstdint>
 #include <chrono>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <stdio.h>
+
+// The buffers a suffix array is built in.
+//
+// Keeping a workspace from block to block saves allocating, freeing and
+// page faulting the buffers each time.
+template<class addr_t=std::uint32_t, class allocator_t=std::allocator<char>>
+class suffix_array_workspace {
+  template <class Ty>
+  using vector_t = std::vector<Ty, typename std::allocator_traits<allocator_t>::template rebind_alloc<Ty>>;
+
+public:
+  typedef uint64_t sorter_t;
+
+  suffix_array_workspace(const allocator_t &alloc = allocator_t()) : sorter(alloc), rank(alloc), keys(alloc) {}
+
+  // bytes used for a block of size values.
+  static size_t bytes(size_t size) {
+    return (size + 1) * (sizeof(sorter_t) + sizeof(addr_t) * 2);
+  }
+
+  // the largest block the buffers hold without growing.
+  size_t capacity() const { return rank.empty() ? 0 : rank.size() - 1; }
+
+  // allocate and touch the buffers up front.
+  void reserve(size_t size) {
+    sorter.reserve(size + 1);
+    rank.resize(std::max(rank.size(), size + 1));
+    keys.resize(std::max(keys.size(), size + 1));
+  }
+
+  // map pattern to string
+  vector_t<sorter_t> sorter;
+
+  // map string to pattern
+  vector_t<addr_t> rank;
+
+  // scratch space for the sort keys of a group.
+  vector_t<addr_t> keys;
+};
+
+// Hands out workspaces to threads building suffix arrays at the same time.
+//
+// The workspaces the pool owns, in use or free, never total more than the
+// memory budget so the memory used stays predictable however many threads
+// there are. Threads wait in acquire() for enough of the budget to be
+// released. A request larger than the whole budget waits until it can have
+// the pool to itself.
+template<class workspace_t=suffix_array_workspace<>>
+class suffix_array_workspace_pool {
+public:
+  static const size_t default_budget = size_t(512) << 20;
+
+  suffix_array_workspace_pool(size_t budget = default_budget) : budget_(budget) {}
+
+  // the pool shared by the encoders in this process.
+  static suffix_array_workspace_pool &shared() {
+    static suffix_array_workspace_pool pool;
+    return pool;
+  }
+
+  void set_budget(size_t budget) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    budget_ = budget;
+    cv_.notify_all();
+  }
+
+  // bytes in the workspaces the pool owns.
+  size_t bytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return bytes_;
+  }
+
+  // a workspace for blocks of up to size values.
+  workspace_t *acquire(size_t size) {
+    size_t needed = workspace_t::bytes(size);
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+      auto fits = std::find_if(free_.begin(), free_.end(), [&](workspace_t *w) { return w->capacity() >= size; });
+      if (fits != free_.end()) {
+        workspace_t *result = *fits;
+        free_.erase(fits);
+        return result;
+      }
+      if (bytes_ + needed <= budget_ || all_.empty()) {
+        all_.emplace_back(new workspace_t());
+        all_.back()->reserve(size);
+        bytes_ += workspace_t::bytes(all_.back()->capacity());
+        return all_.back().get();
+      }
+      if (!free_.empty()) {
+        // free workspaces that are too small make room for a larger one.
+        destroy(free_.back());
+        free_.pop_back();
+        continue;
+      }
+      cv_.wait(lock);
+    }
+  }
+
+  void release(workspace_t *workspace) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    free_.push_back(workspace);
+    cv_.notify_all();
+  }
+
+  // acquire a workspace for the lifetime of this object.
+  class lease {
+  public:
+    lease(suffix_array_workspace_pool &pool, size_t size) : pool_(pool), workspace_(pool.acquire(size)) {}
+    ~lease() { pool_.release(workspace_); }
+    workspace_t &operator*() const { return *workspace_; }
+  private:
+    lease(const lease &) = delete;
+    suffix_array_workspace_pool &pool_;
+    workspace_t *workspace_;
+  };
+
+private:
+  void destroy(workspace_t *workspace) {
+    bytes_ -= workspace_t::bytes(workspace->capacity());
+    all_.erase(std::find_if(all_.begin(), all_.end(), [&](const std::unique_ptr<workspace_t> &w) { return w.get() == workspace; }));
+  }
+
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  size_t budget_;
+  size_t bytes_ = 0;
+  std::vector<std::unique_ptr<workspace_t>> all_;
+  std::vector<workspace_t *> free_;
+};
 
 template<class value_t=std::uint8_t, class addr_t=std::uint32_t, class allocator_t=std::allocator<char>>
 class suffix_array {
-  typedef uint64_t sorter_t;
+public:
+  typedef suffix_array_workspace<addr_t, allocator_t> workspace_t;
+
+private:
+  typedef typename workspace_t::sorter_t sorter_t;
   static addr_t adr(sorter_t v) { return (addr_t)v; }
   static addr_t grp(sorter_t v) { return (addr_t)(v >> 32); }
   static sorter_t make(addr_t g, addr_t a) { return ((sorter_t)g << 32) | a; }
 
 public:
-  suffix_array(const value_t *begin, const value_t *end) {
+  // build in a workspace of our own.
+  suffix_array(const value_t *begin, const value_t *end) : owned_(new workspace_t()), ws_(*owned_) {
+    build(begin, end);
+  }
+
+  // build in a workspace that outlives this object and can be reused for the next block.
+  suffix_array(workspace_t &workspace, const value_t *begin, const value_t *end) : ws_(workspace) {
+    build(begin, end);
+  }
+
+  size_t size() const { return ws_.sorter.size(); }
+  addr_t addr(size_t i) const { return adr(ws_.sorter[i]); }
+  addr_t rank(size_t i) const { return ws_.rank[i]; }
+
+private:
+  void build(const value_t *begin, const value_t *end) {
     auto t0 = std::chrono::high_resolution_clock::now();
     constexpr bool debug_full = false;
     constexpr bool debug_stats = false;
@@ -37,9 +190,11 @@ public:
     addr_t size = addr_t(end - begin);
     constexpr int asz = sizeof(addr_t);
 
-    sorter_.reserve(size+1);
+    auto &sorter_ = ws_.sorter;
+    auto &rank_ = ws_.rank;
+    auto &keys_ = ws_.keys;
+    ws_.reserve(size);
     sorter_.resize(0);
-    rank_.resize(size+1);
 
     {
       auto t0 = std::chrono::high_resolution_clock::now();
@@ -135,10 +290,13 @@ public:
         if (j != i+1) {
           num_sorts++;
           tot_sorts += j - i;
+          // find all the keys before changing any, addr+h may be in this group.
           for (addr_t k = i; k != j; ++k) {
             addr_t addr = adr(sorter_[k]);
-            addr_t next_group = addr + h < size+1 ? grp(sorter_[rank_[addr+h]]) : 0;
-            sorter_[k] = make(next_group, addr);
+            keys_[k] = addr + h < size+1 ? grp(sorter_[rank_[addr+h]]) : 0;
+          }
+          for (addr_t k = i; k != j; ++k) {
+            sorter_[k] = make(keys_[k], adr(sorter_[k]));
           }
 
           if (false && j - i == 20) {
@@ -190,19 +348,8 @@ public:
     }
   }
 
-  size_t size() const { return sorter_.size(); }
-  addr_t addr(size_t i) const { return adr(sorter_[i]); }
-  addr_t rank(size_t i) const { return rank_[i]; }
-  
-private:
-  // map pattern to string
-  std::vector<sorter_t, allocator_t> sorter_;
-
-  // longest common prefix
-  std::vector<addr_t, allocator_t> lcp_;
-
-  // map string to pattern
-  std::vector<addr_t, allocator_t> rank_;
+  std::unique_ptr<workspace_t> owned_;
+  workspace_t &ws_;
 };
 
 #endif
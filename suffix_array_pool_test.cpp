@@ -0,0 +1,77 @@
+// threads leasing workspaces from a suffix_array_workspace_pool never hold
+// more than its budget, and block sorting through a pool round trips.
+
+#include <stdio.h>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <random>
+
+#include "block_sorting_encoder.hpp"
+
+struct context {
+  size_t size;
+
+  void error(size_t, const char *) {}
+};
+
+int main() {
+  typedef suffix_array_workspace<uint32_t> workspace_t;
+  static const size_t block_size = 0x10000;
+  static const size_t num_threads = 8;
+
+  std::mt19937 rng(1);
+  std::vector<uint8_t> data(block_size * 4);
+  for (auto &b : data) b = uint8_t('a' + rng() % 4);
+
+  // room for three full size workspaces.
+  suffix_array_workspace_pool<> pool(workspace_t::bytes(block_size) * 3);
+  std::atomic<size_t> held{0};
+  std::atomic<size_t> max_held{0};
+  std::atomic<int> failures{0};
+
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t != num_threads; ++t) {
+    threads.emplace_back([&, t]() {
+      for (size_t i = 0; i != 8; ++i) {
+        // a mix of block sizes so that small workspaces make way for larger ones.
+        size_t size = (t + i) % 3 == 0 ? block_size / 4 : block_size;
+        suffix_array_workspace_pool<>::lease workspace(pool, size);
+        size_t now = held += workspace_t::bytes((*workspace).capacity());
+        for (size_t prev = max_held; now > prev && !max_held.compare_exchange_weak(prev, now); ) {}
+        if (pool.bytes() > workspace_t::bytes(block_size) * 3 || (*workspace).capacity() < size) ++failures;
+
+        const uint8_t *text = data.data() + (t * 4096 + i * 512) % (data.size() - size);
+        suffix_array<uint8_t, uint32_t> sa(*workspace, text, text + size);
+        for (size_t row = 1; row < size; row += 97) {
+          uint32_t a = sa.addr(row), b = sa.addr(row + 1);
+          size_t n = std::min(size - a, size - b);
+          int cmp = memcmp(text + a, text + b, n);
+          if (cmp > 0 || (cmp == 0 && size - a > size - b)) ++failures;
+        }
+        held -= workspace_t::bytes((*workspace).capacity());
+      }
+    });
+  }
+  for (auto &t : threads) t.join();
+
+  if (failures || max_held > workspace_t::bytes(block_size) * 3) {
+    printf("pool budget exceeded or bad suffix array: %d failures, %ld bytes held at most\n", int(failures), long(max_held));
+    return 1;
+  }
+
+  // block sorting through the pool round trips.
+  context ctxt;
+  std::vector<uint8_t> coded(range_block::bound(data.size(), block_size) + (data.size() / block_size + 1) * 4);
+  auto coded_end = block_sorting_encoder(ctxt, coded.data(), coded.data() + coded.size(), data.data(), data.data() + data.size(), pool, block_size);
+  std::vector<uint8_t> decoded(data.size());
+  ctxt.size = data.size();
+  auto decoded_end = block_sorting_decoder(ctxt, decoded.data(), decoded.data() + decoded.size(), coded.data(), coded_end);
+  if (decoded_end != decoded.data() + decoded.size() || decoded != data) {
+    printf("block sorting round trip failed\n");
+    return 1;
+  }
+
+  printf("ok\n");
+  return 0;
+}